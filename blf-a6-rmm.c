@@ -56,27 +56,90 @@
 *   theoretical formula.
 *
 *   Same for off-time capacitor values.  Measure, don't guess.
+*
+* STARTUP
+*	  The cap and the battery (at rest, for the boot check) are read
+*	  first, then solid modes are latched before the battery check, the
+*	  config wipe and any EEPROM writes.  Power-on-to-light from the end
+*	  of the reset start-up delay (SUT=01, 14CK + 4ms), "boot to light"
+*	  of sim/simbench.sh, run on a clang/lld build in a simulator built
+*	  on the simavr API, not on avr-gcc and simavr:
+*
+*		ATtiny13 at 4.8MHz      ~3800 cycles, 0.79ms
+*		ATtiny25/85 at 8MHz     ~4900 cycles, 0.61ms, 100us of it waiting for the PLL
+*
+*	  Short, medium and long presses into a solid mode, fresh EEPROM or
+*	  not, are within 60 cycles of each other.  About 3300 cycles of it
+*	  are the ADC: the cap read the stock way, a throw-away conversion and
+*	  one more at clk/64, then one battery conversion.  Those don't
+*	  depend on the compiler, the rest may run a little different on an
+*	  avr-gcc build.  Hidden modes light up in the main loop, after the
+*	  first battery reading.
 */
 
 #include "driver.h"
 #include "default_modes.h"
 
 // Volatile globals
-uint8_t fast_presses __attribute__ ((section (".noinit"))); // counter for entering config mode
-uint8_t locked_in  __attribute__ ((section (".noinit")));   // LOCK_MODE variable
+uint8_t mode_mem   __attribute__ ((section (".noinit")));   // Last mode index, newer than EEPROM until it has been held for SAVE_DELAY
+uint8_t mode_check __attribute__ ((section (".noinit")));   // ~mode_mem, tells whether RAM survived the off time
+#ifdef THERMAL_REG
+int16_t therm_integ;                                         // Integral term of the temperature regulator
+#endif
+#ifdef HEAT_MODEL
+uint16_t heat       __attribute__ ((section (".noinit")));  // Heat model for the step-down, see HEAT_LIMIT
+#endif
 
 // Constant globals
-const uint8_t voltage_blinks[] = {
-	ADC_0,    // 1 blink  for 0%-25%
-	ADC_25,   // 2 blinks for 25%-50%
-	ADC_50,   // 3 blinks for 50%-75%
-	ADC_75,   // 4 blinks for 75%-100%
-	ADC_100,  // 5 blinks for >100%
-	255       // Don't remove this, it's a limiter
+#ifdef BATT_VOLTS
+const uint16_t volts_table[VOLTS_CNT] PROGMEM = {
+	VOLTS(0),  VOLTS(1),  VOLTS(2),  VOLTS(3),  VOLTS(4),  VOLTS(5),  VOLTS(6),
+	VOLTS(7),  VOLTS(8),  VOLTS(9),  VOLTS(10), VOLTS(11), VOLTS(12), VOLTS(13),
+	VOLTS(14), VOLTS(15), VOLTS(16), VOLTS(17), VOLTS(18), VOLTS(19)
 };
+#else
+const uint16_t voltage_blinks[] PROGMEM = {
+	ADC_0_HR,    // 1 blink  for 0%-25%
+	ADC_25_HR,   // 2 blinks for 25%-50%
+	ADC_50_HR,   // 3 blinks for 50%-75%
+	ADC_75_HR,   // 4 blinks for 75%-100%
+	ADC_100_HR,  // 5 blinks for >100%
+	0xFFFF       // Don't remove this, it's a limiter
+};
+#endif
+
+#ifdef DEBUG
+// Send one byte on DEBUG_PIN.  Interrupts are held off for the ~1ms it
+// takes, so delays run a little long in DEBUG builds.
+static void debug_byte(uint8_t b) {
+	uint16_t frame = (b << 1) | 0x200; // Start bit, 8 data bits LSB first, stop bit
+	uint8_t sreg = SREG;
+	uint8_t i;
+	cli();
+	for (i = 10; i; i--) {
+		if (frame & 1) {
+			PORTB |= (1 << DEBUG_PIN);
+		} else {
+			PORTB &= ~(1 << DEBUG_PIN);
+		}
+		frame >>= 1;
+		_delay_loop_2(DEBUG_BIT);
+	}
+	SREG = sreg;
+}
+
+static void debug_rec(uint8_t tag, uint16_t value) {
+	debug_byte(DEBUG_SYNC);
+	debug_byte(tag);
+	debug_byte(value);
+	debug_byte(value >> 8);
+}
+#else
+#define debug_rec(tag, value)
+#endif
 
 // EEPROM_read/write taken from the datasheet
-void EEPROM_write(uint8_t address, uint8_t data) {
+static void EEPROM_write(uint8_t address, uint8_t data) {
 	EECR = (0<<EEPM1)|(0<<EEPM0); // Atomic write mode, EEPM0:1 value 0b00
 	EEAR = address;               // Set EEAR (eeprom address register) to the eeprom address to perform the operation on
 	EEDR = data;                  // Set EEDR (eeprom data register) to the data to be written
@@ -85,350 +148,796 @@ void EEPROM_write(uint8_t address, uint8_t data) {
 	while(EECR & (1<<EEPE));      // Wait for completion of write (the EEPE bit in EECR (eeprom control register) will stay set until eeprom write completes)
 }
 
-inline uint8_t EEPROM_read(uint8_t address) {
+static uint8_t EEPROM_read(uint8_t address) {
 	while(EECR & (1<<EEPE));      // Wait for the completion of any write operations (if any).  See this same loop in EEPROM_write for more details.
 	EEAR = address;               // Set EEAR (eeprom address register) to the eeprom address to perform the operation on
 	EECR |= (1<<EERE);            // Start eeprom read by ORing 1 into EERE (eeprom read enable) in the EECR (eeprom control register)
 	return EEDR;                  // Return data from EEDR (eeprom data register)
 }
 
-inline void EEPROM_erase(uint8_t address) {
-	EEAR = address;               // Set EEAR (eeprom address register) to the eeprom address to perform the operation on
-	EECR = (0<<EEPM1)|(1<<EEPM0); // Set EECR (eeprom control register) EEPM bits (eeprom program mode) to 0b01, which translates to erase mode
-	EECR |= (1<<EEMPE);           // Set EEMPE (eeprom master program enable) in EECR (eeprom control register), this must be done BEFORE starting the erase operation to enable writing to the eeprom
-	EECR |= (1<<EEPE);            // Set EEPE (eeprom program enable) in EECR (eeprom control register), this starts the erase operation
-	while(EECR & (1<<EEPE));      // Wait for write completion (see this same loop in EEPROM_write for more details)
+#ifdef USAGE_LOG
+static uint16_t usage_read(uint8_t addr) {
+	return ~(EEPROM_read(addr) | (EEPROM_read(addr + 1) << 8));
 }
 
-inline uint8_t reverse_idx(uint8_t config, uint8_t mode_idx) {
-	// Reverse the index if the config option is set and the index is in normal modes
-	if ((config & MODE_DIR) && (mode_idx < NUM_MODES) && !(config & MUGGLE)) {
-		mode_idx = (NUM_MODES - 1 - mode_idx);
+// Add n to a usage counter, saturating, and write only the bytes that changed
+static void usage_add(uint8_t addr, uint16_t n) {
+	uint16_t old = usage_read(addr);
+	uint16_t v = old + n;
+	if (v < old) {
+		v = 0xFFFF;
 	}
-	return mode_idx;
-}
-
-// Write mode index to EEPROM (with wear leveling)
-uint8_t save_mode_idx(uint8_t mode_idx, uint8_t config, uint8_t eepos) {
-	mode_idx = reverse_idx(config, mode_idx); // Reverse the mode index if needed
-	EEPROM_erase(eepos);                      // Erase the previous position
-
-	if (eepos == EEPMODE) {                   // Wear leveling, use next cell, roll over if we hit the end of mode index storage
-		eepos=0;
-		} else {
-		eepos++;
+	if ((uint8_t)v != (uint8_t)old) {
+		EEPROM_write(addr, ~v);
+	}
+	if ((v >> 8) != (old >> 8)) {
+		EEPROM_write(addr + 1, ~(v >> 8));
 	}
-
-	EEPROM_write(eepos, ~mode_idx);           // save current index, flipped because empty bits are 0xFF.  This allows for storing index 0.
-	return eepos;
 }
+#endif
 
+#include "ui.h"
 
-void save_config(uint8_t config) {
-	EEPROM_write(EEPLEN, ~config); // Config is stationary
+// Keep the mode index in RAM, so short presses find it before it's been saved
+static void remember_mode(uint8_t mode_idx, uint8_t config) {
+	mode_mem = reverse_idx(config, mode_idx);
+	mode_check = ~mode_mem;
 }
 
-inline void ADC_on(uint8_t dpin, uint8_t channel) {
+#if defined(ADC_OVERSAMPLE) || defined(THERMAL_REG)
+EMPTY_INTERRUPT(ADC_vect); // Conversion complete, only wakes us up
+
+static inline void ADC_on(uint8_t dpin, uint8_t channel) {
 	DIDR0 |= (1 << dpin);                             // Disable digital input on analog channel by setting the DIDR0 (Digital Input Disable Register) bit in the position for that pin
-	ADMUX  = (1 << V_REF) | (1 << ADLAR) | channel;   // Set ADMUX (ADC Multiplexer Selection Register) bits: ADLAR (ADC Left Adjust Result), V_REF (1.1v reference, different between attiny13 and 25/45/85), channel selects which pin to reference to
-	ADCSRA = (1 << ADEN ) | (1 << ADSC ) | ADC_PRSCL; // Set ADCSRA (ADC control and status register A) bits: ADEN (ADC Enable, turns on the ADC), ADSC (ADC start conversion), and set the prescaler bits to ADC_PRSCL, different between attiny13 and 25/45/85
+	ADMUX  = (1 << V_REF) | channel;                  // Set ADMUX (ADC Multiplexer Selection Register) bits: V_REF (1.1v reference, different between attiny13 and 25/45/85), channel selects which pin to reference to, result is right adjusted for all 10 bits
+	ADCSRA = (1 << ADEN ) | (1 << ADSC ) | (1 << ADIE) | ADC_PRSCL; // Set ADCSRA (ADC control and status register A) bits: ADEN (ADC Enable, turns on the ADC), ADSC (ADC start conversion), ADIE (ADC interrupt enable, to wake from noise reduction sleep), and set the prescaler bits to ADC_PRSCL, different between attiny13 and 25/45/85
+	sei();                                            // The conversion complete interrupt has to get through
 	while (ADCSRA & (1 << ADSC));                     // Wait for the result (ADSC stays set until a result is returned), the first one is garbage so we don't read it
 }
 
-uint8_t get_voltage() {
-	ADCSRA |= (1 << ADSC);        // Set ADCSRA (ADC control and status register A) bit ADSC (ADC Start Conversion) to start the ADC conversion process
-	while (ADCSRA & (1 << ADSC)); // Wait for the result (ADSC stays set until a result is returned)
-	return ADCH;
+// Sum of ADC_SAMPLES 10-bit conversions, each taken asleep so the CPU doesn't
+// disturb it.  ADC noise reduction sleep stops the timer clock too, which would
+// hold a PWM pin at whatever level it was at for the ~0.2ms of a conversion,
+// so it's only used while both outputs are off or fully on.  Otherwise the
+// conversions run in idle sleep, with PWM switching and the overflow interrupt.
+static uint16_t get_voltage() {
+	uint16_t sum = 0;
+	uint8_t n;
+	if ((uint8_t)(PWM_LVL + 1) > 1 || (uint8_t)(ALT_PWM_LVL + 1) > 1) {
+		set_sleep_mode(SLEEP_MODE_IDLE);
+	} else {
+		set_sleep_mode(SLEEP_MODE_ADC);
+	}
+	for (n = ADC_SAMPLES; n; n--) {
+		ADCSRA |= (1 << ADSC);        // Idle sleep doesn't start a conversion by itself
+		do {
+			sleep_mode();
+		} while (ADCSRA & (1 << ADSC)); // Woken up by something else, keep sleeping until the result is in
+		sum += ADC;
+	}
+	return sum;
 }
-
-inline void set_output(uint8_t pwm1, uint8_t pwm2) {
+#endif
+
+#if defined(PLL_PWM) && PWM1_TOP != 255
+uint8_t fet_lvl;        // Unscaled FET level, OCR1A holds it scaled to PWM1_TOP
+#define FET_LVL fet_lvl
+#else
+#define FET_LVL PWM_LVL
+#endif
+
+// Out of line, with PLL_PWM every inlined copy costs more than the call
+static __attribute__ ((noinline)) void set_output(uint8_t pwm1, uint8_t pwm2) {
+#ifdef PLL_PWM
+	// Timer1 PWM still pulses at OCR1A 0, so a FET that's off is disconnected
+	TCCR1 = pwm1 ? (1 << PWM1A) | (1 << COM1A1) | PWM1_CLK : (1 << PWM1A) | PWM1_CLK;
+#if PWM1_TOP != 255
+	fet_lvl = pwm1;
+	pwm1 = ((uint16_t)pwm1 * (PWM1_TOP + 1)) >> 8;
+#endif
+#endif
+#ifdef DITHER
+	dither_frac = 0;    // Plain levels, the overflow interrupt leaves OCR0A alone
+	dither_base = pwm2;
+#endif
 	PWM_LVL = pwm1;     // Set FET output
 	ALT_PWM_LVL = pwm2; // Set voltage regulator output
 }
 
-void blink(uint8_t val, uint8_t speed, uint8_t fetbr, uint8_t regbr) {
+#ifdef RAMPING
+// Next level on the way from cur to target, one ramp_curve[] entry further
+static uint8_t ramp_step(uint8_t cur, uint8_t target) {
+	uint8_t i = 0;
+	uint8_t lvl;
+	if (cur < target) {
+		while ((lvl = pgm_read_byte(&ramp_curve[i])) <= cur) i++; // The curve ends at 255, so this stops
+		return (lvl < target) ? lvl : target;
+	}
+	if (cur > target) {
+		i = RAMP_STEPS - 1;
+		while ((lvl = pgm_read_byte(&ramp_curve[i])) >= cur) i--; // The curve starts at 0, so this stops
+		return (lvl > target) ? lvl : target;
+	}
+	return cur;
+}
+
+// Slew both channels from their current levels to fet/reg
+static void ramp_to(uint8_t fet, uint8_t reg) {
+	uint8_t cur_fet = FET_LVL;
+#ifdef DITHER
+	uint8_t cur_reg = dither_base; // OCR0A may be one step up mid-sequence
+#else
+	uint8_t cur_reg = ALT_PWM_LVL;
+#endif
+	while (cur_fet != fet || cur_reg != reg) {
+		cur_fet = ramp_step(cur_fet, fet);
+		cur_reg = ramp_step(cur_reg, reg);
+		set_output(cur_fet, cur_reg);
+		_delay_5_ms(CLOCK_MS(RAMP_STEP_MS));
+	}
+}
+#else
+#define ramp_to set_output
+#endif
+
+#ifdef FET_COMP
+// Scale a FET level by comp_table[] for the battery voltage
+static uint8_t fet_comp(uint8_t fet, uint16_t voltage) {
+	uint16_t step = 0;
+	uint16_t out;
+	if (fet == 255) {                           // Can't go any higher, and turbo-ish levels shouldn't drop either
+		return fet;
+	}
+	if (voltage > ADC_LOW_HR) {
+		step = (voltage - ADC_LOW_HR) >> COMP_SHIFT;
+		if (step > 15) {
+			step = 15;
+		}
+	}
+	out = ((uint16_t)fet * pgm_read_byte(&comp_table[step])) >> 7; // 254 * 160 overflows an int
+	return (out > 255) ? 255 : out;
+}
+#else
+#define fet_comp(fet, voltage) (fet)
+#endif
+
+static void blink(uint8_t val, uint8_t speed, uint8_t fetbr, uint8_t regbr) {
 	for (; val; val--) {
-		PWM_LVL = fetbr;		// Set the FET to specified brightness
-		ALT_PWM_LVL = regbr;	// Set the regulator to specified brightness
-		_delay_10_ms(speed);    // Sleep for a bit
-		PWM_LVL = 0;			// Turn of the FET
-		ALT_PWM_LVL = 0;        // Turn off the reg
-		_delay_10_ms(speed); _delay_10_ms(speed); // Sleep for twice as long
+		set_output(fetbr, regbr); // Set both channels to specified brightness
+		_delay_10_ms(speed);      // Sleep for a bit
+		set_output(0, 0);         // Turn off the FET and the reg
+		_sleep_10_ms(speed); _sleep_10_ms(speed); // Sleep for twice as long, output is off
 	}
 }
 
-void emergency_shutdown(){
-	// Shut down, voltage is too low.
-	ADCSRA &= ~_BV(ADEN);				 // Shutdown ADC to save power
-	power_all_disable();				 // Shutdown all modules to save even more power
-	set_sleep_mode(SLEEP_MODE_PWR_DOWN); // Power down as many components as possible
-	set_output(0,0);                     // Turn off output
-	sleep_bod_disable();				 // Turn off brown out detection, would use unnecessary power 
-	sleep_mode();                        // Go to deep sleep
+#if defined(USAGE_LOG) || defined(BATT_VOLTS)
+const uint16_t decades[] PROGMEM = { 10000, 1000, 100, 10, 1 };
+
+// Blink a number one digit at a time, a zero digit is a single short blip
+static void blink_num(uint16_t n) {
+	uint8_t i, d;
+	uint8_t lead = 1;
+	for (i = 0; i < 5; i++) {
+		uint16_t dec = pgm_read_word(&decades[i]);
+		for (d = 0; n >= dec; d++) {
+			n -= dec;
+		}
+		if (d || !lead || dec == 1) {  // Skip leading zeros, but show a lone 0
+			lead = 0;
+			if (d) {
+				blink(d, 20, BLINK_BRIGHTNESS);
+			} else {
+				blink(1, 4, BLINK_BRIGHTNESS);
+			}
+			_sleep_10_ms(100);
+		}
+	}
+}
+#endif
+
+// Software timers on clock_5ms, one deadline for each thing the main loop keeps time for
+#define T_BAT       0   // Next battery sample, heat model or thermal regulation step
+#define T_LOCK      1   // Lock-in
+#define TIMERS      2
+uint16_t timer_at[TIMERS]; // All due at reset
+
+static void timer_set(uint8_t t, uint16_t ticks) {
+	timer_at[t] = clock_now() + ticks;
+}
+
+static uint8_t timer_due(uint8_t t) {
+	return (int16_t)(clock_now() - timer_at[t]) >= 0; // Deadlines are never more than ~160s out
+}
+
+const uint8_t *pat_step; // Next step of the pattern being played, 0 to start over
+uint8_t pat_reps;
+
+// Show the next step of a blink pattern from flash, see default_modes.h for
+// the format, and idle until it's over.  Dark steps power down instead.
+// Steps are timed from here, so the main loop doesn't idle after them.
+static void pattern_run(const uint8_t *pattern) {
+	const uint8_t *step = pat_step;
+	uint8_t fet, reg, len;
+	for (;;) {
+		if (!step) {
+			step = pattern;
+			pat_reps = 0;
+		}
+		fet = pgm_read_byte(step++);
+		reg = pgm_read_byte(step++);
+		len = pgm_read_byte(step++);
+		if (len) {
+			break;
+		}
+		// Control step
+		if (!fet) {                          // End of pattern, loop it
+			step = 0;
+		} else {
+			if (!pat_reps) {                 // First time here, load the repeat count
+				pat_reps = fet;
+			}
+			if (--pat_reps) {                // Jump back to the first repeated step
+				step -= reg;
+			}
+		}
+	}
+	pat_step = step;
+	set_output(fet, reg);
+	if (fet | reg) {
+		_delay_5_ms(len);
+	} else {
+		_sleep_5_ms(len);
+	}
 }
 
 
-inline void set_lock(uint8_t config) {
-	if (config & LOCK_MODE) {
-		_delay_10_ms(255); // Delay for 2.55 seconds
-		locked_in = 1;     // Lock the output
+#ifdef CAP_CAL
+#define CAL_ARMED   1   // Turned off during the menu buzz, the next press doesn't count
+#define CAL_SHORT   2   // Waiting for a short press
+#define CAL_MED     3   // Waiting for a medium press
+uint8_t cal_state __attribute__ ((section (".noinit")));
+uint8_t cal_check __attribute__ ((section (".noinit"))); // ~cal_state, tells whether RAM survived the off time
+uint8_t cal_short __attribute__ ((section (".noinit"))); // 8-bit cap reading of the short press
+
+static void cal_set(uint8_t state) {
+	cal_state = state;
+	cal_check = ~state;
+}
+
+// One step of the press calibration per power-on, see CAP_CAL in default_modes.h
+static void cap_calibrate(uint8_t cap) {
+	uint8_t state = cal_state;
+	cal_set(0);
+	if (cap < CAP_CAL_MARGIN) {            // Long press, cancelled
+		return;
 	}
+	if (state == CAL_ARMED) {
+		cal_set(CAL_SHORT);
+		blink(1, 25, BLINK_BRIGHTNESS);
+	} else if (state == CAL_SHORT) {
+		cal_short = cap;
+		cal_set(CAL_MED);
+		blink(2, 25, BLINK_BRIGHTNESS);
+	} else if (state == CAL_MED) {
+		if (cap + CAP_CAL_MARGIN <= cal_short) {
+			// Long presses read under half a medium one, short ones above the middle
+			EEPROM_write(CAP_CAL_EEP, cap >> 1);
+			EEPROM_write(CAP_CAL_EEP + 1, ((uint16_t)cap + cal_short) >> 1);
+			blink(48, 1, BLINK_BRIGHTNESS);
+		} else {
+			blink(8, 5, BLINK_BRIGHTNESS);
+		}
+	}                                      // Any other state is leftover RAM, it does nothing
+}
+#endif
+
+#ifdef CONFIG_MENU
+static void _delay_s()  // because it saves a bit of ROM space to do it this way
+{
+	_delay_10_ms(100);
 }
 
-inline void configure_output() {
+// Toggle each option in turn, saved, for as long as the buzz lasts
+static void config_menu_run(uint8_t config) {
+	uint8_t n;
+	for (n = 0; n < sizeof(config_menu); n++) {
+		uint8_t bit = pgm_read_byte(&config_menu[n]);
+		blink(n + 1, 12, BLINK_BRIGHTNESS);
+		_delay_10_ms(5);
+		save_config(config ^= bit);
+		blink(48, 1, BLINK_BRIGHTNESS);
+		save_config(config ^= bit);
+		_delay_s();
+	}
+#ifdef CAP_CAL
+	// One more, arms the press calibration for as long as the buzz lasts
+	blink(n + 1, 12, BLINK_BRIGHTNESS);
+	_delay_10_ms(5);
+	cal_set(CAL_ARMED);
+	blink(48, 1, BLINK_BRIGHTNESS);
+	cal_set(0);
+	_delay_s();
+#endif
+}
+#endif
+
+static inline void configure_output() {
 	// Set PWM pin to output
 	DDRB |= (1 << PWM_PIN);	    // enable main channel
 	DDRB |= (1 << ALT_PWM_PIN); // enable second channel
 	TCCR0A = PHASE;             // Set timer to do PWM
 	TCCR0B = 1;                 // pre-scaler for timer
+#ifdef PLL_PWM
+	// Start the PLL for Timer1 in low speed mode, 32MHz.  The 64MHz mode
+	// needs 2.7V, which a cell sagging under turbo can dip below.
+	PLLCSR = (1 << LSM) | (1 << PLLE);
+	_delay_loop_2(F_CPU / 40000); // It needs 100us before PLOCK can be trusted
+	while (!(PLLCSR & (1 << PLOCK))) {}
+	PLLCSR |= (1 << PCKE);      // Clock Timer1 from the PLL
+	OCR1C = PWM1_TOP;
+	TCCR1 = (1 << PWM1A) | PWM1_CLK; // PWM mode, set_output() connects OC1A
+#endif
+	TIMSK_REG |= (1 << TOIE0);  // Overflow interrupt is the time base for delays
+	sei();
 
 	// Charge up the capacitor by setting CAP_PIN to output
 	DDRB  |= (1 << CAP_PIN);    // Output
 	PORTB |= (1 << CAP_PIN);    // High
 	
+#ifdef DEBUG
+	DDRB  |= (1 << DEBUG_PIN);  // Star3 is the telemetry output, idling high
+	PORTB |= (1 << DEBUG_PIN);
+#else
 	DIDR0 |= (1 << ADC2D);		// Disable Star3 input for power saving. Not needed anyway.
+#endif
 }
 
-inline uint8_t get_cap() {
-	ADC_on(CAP_DIDR, CAP_CHANNEL); // Start up ADC for capacitor pin
-	return get_voltage();
+// A single conversion right away, for the readings taken at power-on before
+// the light is latched, and for every battery reading without ADC_OVERSAMPLE.
+// The battery is read at ADC_PRSCL, clk/32 is over the 200kHz 10-bit limit
+// at 8MHz.  main() has turned off the digital inputs of both pins.
+static uint16_t adc_once(uint8_t channel, uint8_t prscl) {
+	ADMUX  = (1 << V_REF) | channel;
+	ADCSRA = (1 << ADEN) | (1 << ADSC) | prscl;
+	while (ADCSRA & (1 << ADSC));
+	return ADC << 2;               // 10 bits to the oversampled 12-bit scale of the *_HR values
 }
 
-uint8_t get_bat() {
+#ifdef CAP_CAL
+// The first conversion at clk/32.  The cap keeps draining while a throw-away
+// conversion runs, and the first conversion offset is the same on every press,
+// CAP_CAL learns its thresholds through this same path.
+#define get_cap() adc_once(CAP_CHANNEL, CAP_PRSCL)
+#else
+// The stock CAP_SHORT and CAP_MED were measured after a throw-away conversion
+// at clk/64, so without CAP_CAL the cap is read the same way.
+static uint16_t get_cap() {
+	adc_once(CAP_CHANNEL, ADC_PRSCL);
+	return adc_once(CAP_CHANNEL, ADC_PRSCL);
+}
+#endif
+
+// Out of line so that sim/simbench.sh can time it
+static __attribute__ ((noinline)) uint16_t get_bat() {
+#ifdef ADC_OVERSAMPLE
 	ADC_on(ADC_DIDR, ADC_CHANNEL); // Start up ADC for Battery pin
 	return get_voltage();
+#else
+	return adc_once(ADC_CHANNEL, ADC_PRSCL);
+#endif
 }
 
-inline uint8_t med_press(uint8_t mode_idx, uint8_t config, uint8_t i) {
-	if (mode_idx >= MODE_CNT) { // Loop back if we've hit the end of hidden modes
-		mode_idx = 0;
-	} else if ((mode_idx == 0) || ((config & MOON_MODE) && (mode_idx == i))) { // If we're at mode_idx 0, go to hidden modes
-		mode_idx = NUM_MODES;
-	} else if (mode_idx < NUM_MODES) { // Walk backwards if we're in normal modes
-		mode_idx -= i;
-	} else if (mode_idx >= NUM_MODES) { // Walk forward if we're in hidden modes
-		mode_idx += 1;
-	}
-	return mode_idx;
+#ifdef THERMAL_REG
+static uint16_t get_temp() {
+	ADC_on(ADC_DIDR, TEMP_CHANNEL); // Start up ADC for the temperature sensor, it has no pin so the DIDR bit is just the battery one again
+	return get_voltage();
 }
 
-inline uint8_t next(uint8_t mode_idx, uint8_t config, uint8_t i) {
-	mode_idx += i;        // Start out by just incrementing the mode
-	
-	if ((mode_idx >= NUM_MODES) || ((config & MUGGLE) && (mode_idx > (NUM_MODES - 3)))) {
-		mode_idx = 0;	  // If we're at or above the brightest mode, or we're in muggle mode
-						  // and we're above the third-highest mode, drop to the lowest brightness
+// PI regulator, returns the FET level that holds the sensor at TEMP_CEIL
+static uint8_t thermal_reg(uint16_t temp) {
+	int16_t err = temp - TEMP_CEIL_HR;     // Positive when too hot
+	int16_t cut;
+
+	therm_integ += err;
+	if (therm_integ < 0) {                 // Anti-windup, the integral can only hold the level down
+		therm_integ = 0;
+	} else if (therm_integ > ((255 - TEMP_FET_MIN) << TEMP_KI_SHIFT)) {
+		therm_integ = (255 - TEMP_FET_MIN) << TEMP_KI_SHIFT;
 	}
-	
-	return mode_idx;
+
+	cut = err * TEMP_KP + (therm_integ >> TEMP_KI_SHIFT);
+	if (cut < 0) {
+		cut = 0;
+	} else if (cut > 255 - TEMP_FET_MIN) {
+		cut = 255 - TEMP_FET_MIN;
+	}
+	return 255 - cut;
 }
+#endif
 
-inline uint8_t low_batt_stepdown(uint8_t mode_idx) {
-	if (mode_idx == 0) emergency_shutdown(); // If we're already at 0, save state at low and turn off
-	
-	if (mode_idx > TURBO_STEP_DOWN) {        // Drop out of hidden modes to TURBO_STEP_DOWN
-		mode_idx = TURBO_STEP_DOWN;
-	} else {                                 // If we're below TURBO_STEP_DOWN, then reduce the mode index again.
-		mode_idx--;
+// Shut down, voltage is too low.  With LVP_RECOVERY it wakes up on the watchdog
+// every 8s for a while and returns if the cell has recovered, then sleeps for good.
+void emergency_shutdown(){
+	set_output(0,0);                     // Turn off output
+	debug_rec(DBG_LVP, 0);
+#ifdef LVP_RECOVERY
+	uint8_t tries = LVP_RECHECKS;
+	uint16_t voltage;
+	while (tries--) {
+		_sleep_wdt(WDT_8S);              // Power down with BOD, ADC and timer off, the watchdog costs a few uA
+		voltage = get_bat();
+		if (voltage > ADC_LOW_HR + ADC_HYST_HR) {
+			debug_rec(DBG_LVP, voltage);
+			return;
+		}
 	}
+#endif
+	ADCSRA &= ~_BV(ADEN);				 // Shutdown ADC to save power
+	power_all_disable();				 // Shutdown all modules to save even more power
+	set_sleep_mode(SLEEP_MODE_PWR_DOWN); // Power down as many components as possible, the watchdog is off by now
+	sleep_enable();
+	sleep_bod_disable();				 // Turn off brown out detection, would use unnecessary power 
+	sleep_cpu();                         // Go to deep sleep, nothing wakes us up from here
+}
 
-	return mode_idx;
+#ifdef USAGE_LOG
+// Usage not written to EEPROM yet, see USAGE_FLUSH
+uint8_t usage_slot   __attribute__ ((section (".noinit"))); // Slot the buffered minutes belong to
+uint8_t usage_min    __attribute__ ((section (".noinit"))); // Whole minutes buffered
+uint16_t usage_ticks __attribute__ ((section (".noinit"))); // clock_5ms ticks short of a minute
+uint16_t usage_mamin __attribute__ ((section (".noinit"))); // mA-minutes short of a whole mAh
+uint8_t usage_check  __attribute__ ((section (".noinit"))); // Tells whether RAM survived the off time
+uint16_t usage_clock;   // clock_5ms at the last usage_tick()
+
+static inline uint8_t usage_sum() {
+	return ~(usage_slot ^ usage_min ^ (uint8_t)usage_ticks ^ (uint8_t)usage_mamin);
 }
 
-int main(void) {
-	uint8_t cap_val = get_cap(); // Read the off-time cap *first* to get the most accurate reading
+static void usage_flush() {
+	uint16_t mah = 0;
+	usage_add(USAGE_EEP + 2 * usage_slot, usage_min);
+	usage_min = 0;
+	while (usage_mamin >= 60) {
+		usage_mamin -= 60;
+		mah++;
+	}
+	if (mah) {
+		usage_add(USAGE_MAH, mah);
+	}
+}
 
-	configure_output();          // Set up output pins and charge up capacitor
-	
-	uint8_t voltage = get_bat(); // Get the battery voltage
-	
-	if (voltage < ADC_0) {       // If the battery is getting low, flash thrice when turning on or changing brightness
-		blink(3, 5, BLINK_BRIGHTNESS);
+// Count the time since the last call, sleeps included since clock_5ms runs
+// through them, and write it out in USAGE_FLUSH minute lots.  The current
+// comes from the output levels right now, which for blinky modes is a sample
+// of the pattern.
+static void usage_tick(uint8_t mode_idx) {
+	uint8_t slot = mode_idx < USAGE_SLOTS - 1 ? mode_idx : USAGE_SLOTS - 1;
+	uint16_t now = clock_now();
+	usage_ticks += now - usage_clock;
+	usage_clock = now;
+	if (slot != usage_slot && usage_min) {
+		usage_flush();
+	}
+	usage_slot = slot;
+	while (usage_ticks >= CLOCK_MS(60000)) {
+		usage_ticks -= CLOCK_MS(60000);
+		usage_min++;
+		usage_mamin += ((FET_LVL * (uint16_t)(USAGE_FET_MA / 16)) >> 4) + ((ALT_PWM_LVL * (uint16_t)(USAGE_7135_MA / 16)) >> 4);
+	}
+	if (usage_min >= USAGE_FLUSH) {
+		usage_flush();
 	}
+	usage_check = usage_sum();
+}
 
-	if (voltage < ADC_LOW){      // Protect the battery if we're just starting and the voltage is too low.
-		emergency_shutdown();
+// Total minutes of all slots in hours
+static uint16_t usage_hours() {
+	uint16_t hours = 0;
+	uint16_t rest = 0;
+	uint16_t m;
+	uint8_t i;
+	for (i = 0; i < USAGE_SLOTS; i++) {
+		m = usage_read(USAGE_EEP + 2 * i);
+		while (m >= 60) {
+			m -= 60;
+			hours++;
+		}
+		rest += m;
+		if (rest >= 60) {
+			rest -= 60;
+			hours++;
+		}
 	}
+	return hours;
+}
+#endif
 
-	// Keep track of the eeprom position
-	uint8_t eepos = 0;
+#ifdef CRT_SMALL
+// crt-small.S jumps here and main never returns, nothing needs saving
+int main(void) __attribute__ ((OS_main));
+#endif
 
-	// Read config values
-	uint8_t config = ~EEPROM_read(EEPLEN);
+int main(void) {
+	DIDR0 = (1 << CAP_DIDR) | (1 << ADC_DIDR); // Both analog pins, their digital inputs stay off
+	uint16_t cap_val = get_cap(); // Read the off-time cap *first* to get the most accurate reading
+	// The boot battery check wants the cell at rest, so it's read before any load
+	uint16_t voltage = adc_once(ADC_CHANNEL, ADC_PRSCL);
 
-	// Wipe the config if CONFIG_SET is set
-	// or config is empty (fresh flash)
-	if (!(config & CONFIG_SET)) {
-		config = CONFIG_DEFAULT;
-		save_config(config);
-	}
+	configure_output();          // Set up output pins and charge up capacitor
 
-	// First, get the "mode group" (increment value)
-	uint8_t i = MODE1INC; // This is reused a lot, it's set to 2 for mode group 2 step augmentation
-	if (config & MODE_GROUP) {
-		i = MODE2INC;
+	// Everything up to the first set_output() is on the power-on-to-light path,
+	// so only what's needed to resolve the mode happens before it.
+
+#ifdef CONFIG_MENU
+	// Read config values, a wiped or empty one (fresh flash) is written out once the light is on
+	uint8_t config = load_config(); // See ui.h
+#else
+	uint8_t config = CONFIG_DEFAULT; // Only the menu can change it
+#endif
+
+	// Press thresholds, learned ones if this light has been calibrated
+#ifdef CAP_CAL
+	uint16_t cap_short_hr = CAP_SHORT_HR;
+	uint16_t cap_med_hr = CAP_MED_HR;
+	{
+		uint8_t lim_med = EEPROM_read(CAP_CAL_EEP);
+		uint8_t lim_short = EEPROM_read(CAP_CAL_EEP + 1);
+		if (lim_short != 0xFF && lim_med < lim_short) {
+			cap_short_hr = ADC_HR((uint16_t)lim_short);
+			cap_med_hr = ADC_HR((uint16_t)lim_med);
+		}
 	}
+#else
+#define cap_short_hr CAP_SHORT_HR
+#define cap_med_hr   CAP_MED_HR
+#endif
 
 	// Read saved index
 	// mode_idx is the position in the mode arrays to set the output to
-	// Find the config data
-	uint8_t mode_idx = 0;
-	for(eepos=0; eepos<EEPMODE; eepos++) {
-		mode_idx = ~(EEPROM_read(eepos));
-		if (mode_idx) {
-			break;
-		}
+	// Keep track of the eeprom position
+	uint8_t eepos = find_mode_pos();
+	uint8_t mem_ok = (uint8_t)~mode_check == mode_mem; // RAM survived the off time
+	uint8_t mode_idx = last_mode(eepos, mode_mem, mem_ok);
+
+	uint8_t press = PRESS_SHORT;
+	if (cap_val < cap_med_hr) {
+		press = PRESS_LONG;
+	} else if (cap_val < cap_short_hr) {
+		press = PRESS_MED;
 	}
 
 	// Manipulate index depending on config options
-	if (cap_val < CAP_MED || (cap_val < CAP_SHORT && !(config & MED_PRESS))) {
-		// Long press, clear fast_presses
-		fast_presses = 0;
-		// Reset to the first mode if memory isn't set on
-		if (!(config & MEMORY)) {
-			mode_idx = 0;
-		}
-		locked_in = 0;
-		} else if (locked_in && (config & LOCK_MODE)) {
-			// Do nothing
-		} else if ((cap_val < CAP_SHORT) && !(config & MUGGLE)) {
-			// User did a medium press
-			mode_idx = med_press(mode_idx, config, i);
-		} else {
-			// We don't care what the value is as long as it's over 15
-			fast_presses = (fast_presses+1) & 0x1f;
-			// Indicates they did a short press, go to the next mode
-			mode_idx = next(mode_idx, config, i);
+#ifdef CAP_CAL
+	if ((uint8_t)(cal_state - CAL_ARMED) <= CAL_MED - CAL_ARMED && (uint8_t)~cal_check == cal_state) {
+		// Calibration power-on, the press is a sample and moves nothing
+		mode_idx = 0;
+		cap_calibrate(cap_val >> 4);
+	} else
+#endif
+	mode_idx = press_mode(mode_idx, config, press); // See ui.h
+
+#ifndef RAMP_ON_ENTRY
+	if (mode_idx < NUM_MODES) {              // Solid modes light up right away, hidden modes start in the main loop
+#ifdef PWM_PER_MODE
+		pwm_mode = pgm_read_byte(&mode_pwm[mode_idx]);
+#endif
+		set_output(pgm_read_byte(&modesNx[mode_idx]), pgm_read_byte(&modes1x[mode_idx]));
 	}
-	
-	if ((config & MOON_MODE) && !mode_idx) { // If moon mode is on and the index is 0, increment the mode once to disable moon mode
-		mode_idx += i;
+#endif
+
+	// The light is on, now do the slower checks and bookkeeping
+	debug_rec(DBG_CAP, cap_val);
+	debug_rec(DBG_MODE, mode_idx);
+	debug_rec(DBG_EEPOS, eepos);
+
+	if (voltage < ADC_0_HR) {     // If the battery is getting low, flash thrice when turning on or changing brightness
+		blink(3, 5, BLINK_BRIGHTNESS);
 	}
 
-	mode_idx = reverse_idx(config, mode_idx); // Reverse the index if needed
-	
-	// Save resultant index
-	eepos = save_mode_idx(mode_idx, config, eepos);
+	if (voltage < ADC_LOW_HR){    // Protect the battery if we're just starting and the voltage is too low.
+		emergency_shutdown();
+		mode_idx = 0;             // The cell has recovered, start at the bottom
+	}
 
-	// Main running loop
+#ifdef CONFIG_MENU
+	keep_config(config);
+#endif
+
+	// Remember resultant index, it's saved to EEPROM once the mode has been held for a while
+	remember_mode(mode_idx, config);
+
+#ifdef HEAT_MODEL
+	// The head cooled off while the light was off.  A short press is about
+	// one tick, a medium one about two and a long one at least four, which
+	// keeps on the hot side.  Lost RAM means it was off long enough to cool.
+	if (mem_ok) {
+		heat -= heat >> (HEAT_DECAY_SHIFT - press); // PRESS_* count up with the off time
+	} else {
+		heat = 0;
+	}
+#endif
+
+#ifdef USAGE_LOG
+	if (usage_check != usage_sum()) { // Lost RAM, and with it whatever wasn't flushed
+		usage_slot = usage_min = 0;
+		usage_ticks = usage_mamin = 0;
+	}
+#endif
+
+	// Main running loop.  Nothing in it blocks for long except the readouts,
+	// everything it keeps time for has its own deadline, see T_* above.
 	uint8_t ticks = 0;
 	uint8_t lowbatt_overheat_cnt = 0;
+#ifdef LVP_RECOVERY
+	uint8_t crit_cnt = 0;
+#endif
+	uint8_t kind;
+	uint8_t i;                   // Readout digit and blink counts
+#ifdef THERMAL_REG
+	uint8_t fet_max = 255;       // FET ceiling from the temperature regulator
+#endif
+	if (config & LOCK_MODE) {    // Constant without the config menu, then this folds away
+		timer_set(T_LOCK, LOCK_TIME);
+	}
 
 	while(1) {
-		voltage = get_bat();
-
-		if (voltage < ADC_LOW) {
-			lowbatt_overheat_cnt ++;
+		__asm__ volatile ("main_loop:"); // No code, a symbol for sim/simbench.sh to count passes by
+		if (timer_due(T_BAT)) {
+			timer_set(T_BAT, BAT_PERIOD);
+#ifdef CONFIG_MENU
+			if (menu_tick(ticks)) {
+				_delay_s();	      // wait for user to stop fast-pressing button
+				mode_idx = 0;     // Always exit at lowest mode index
+				remember_mode(mode_idx, config);
+				config_menu_run(config); // See config_menu[] in default_modes.h
+			}
+#endif
+			voltage = get_bat();
+			debug_rec(DBG_BAT, voltage);
+			debug_rec(DBG_TICKS, ticks);
+#ifdef USAGE_LOG
+			usage_tick(mode_idx);
+#endif
+
+			if (voltage < ADC_LOW_HR) {
+				lowbatt_overheat_cnt ++;
+#ifdef LVP_RECOVERY
+			} else if (voltage > ADC_LOW_HR + ADC_HYST_HR) {
+#else
 			} else {
-			lowbatt_overheat_cnt = 0;
-		}
+#endif
+				lowbatt_overheat_cnt = 0;
+			}
 
-		// See if the battery has been low for a while
-		// or the temperature has been high for a while
-		// and step down if so.
-		if (lowbatt_overheat_cnt >= 8) {
-			// Reset the counter
-			lowbatt_overheat_cnt = 0;
-			mode_idx = low_batt_stepdown(mode_idx);
-			// Save the index so we don't jump back to high when
-			// the user fast presses again
-			eepos = save_mode_idx(mode_idx, config, eepos);
-		}
+#ifdef LVP_RECOVERY
+			// Below the critical level there's no stepping down, cut off
+			// right away (two readings in a row, so one dip doesn't do it)
+			if (voltage < ADC_CRIT_HR) {
+				if (++crit_cnt >= 2) {
+					crit_cnt = 0;
+					lowbatt_overheat_cnt = 0;
+					emergency_shutdown();
+					mode_idx = 0;       // Back on after the cell recovered, start at the bottom
+					remember_mode(mode_idx, config);
+				}
+			} else {
+				crit_cnt = 0;
+			}
+#endif
+
+			// See if the battery has been low for a while
+			// and step down if so.
+			if (lowbatt_overheat_cnt >= 8) {
+				// Reset the counter
+				lowbatt_overheat_cnt = 0;
+				mode_idx = low_batt_stepdown(mode_idx);
+				// Remember the index so we don't jump back to high when
+				// the user fast presses again
+				remember_mode(mode_idx, config);
+			}
 
-/*		
-		// Config mode is for dummies, real men hard codes everything (or I might have broken it somehow)
-		if (fast_presses > 0x0f) {
-			_delay_s();	      // wait for user to stop fast-pressing button
-			fast_presses = 0; // exit this mode after one use
-			mode_idx = 0;     // Always exit at lowest mode index
-			
-			// Loop through each config option, toggle, blink the mode number,
-			// buzz a second for user to confirm, toggle back.
-			//
-			// Config items:
-			//
-			// 1  = Mode Group
-			// 2  = Mode Memory
-			// 4  = Reverse Mode Order
-			// 8  = Medium Press Disable
-			// 16 = Mode Locking
-			// 32 = Moon Mode disable
-			// 64 = Reset configuration
-			//
-			// Each toggle's blink count will be
-			// linear, so 1 blink for Mode Group,
-			// 3 blinks for Reverse Mode Order,
-			// 4 blinks for Medium Press.
-			
-			uint8_t blinks=1;
-			for (i=1; i; i<<=1, blinks++) {
-				blink(blinks, 12, BLINK_BRIGHTNESS);
-				_delay_10_ms(5);
-				save_config(config ^= i);
-				blink(48, 1, BLINK_BRIGHTNESS);
-				save_config(config ^= i);
-				_delay_s();
+#ifdef THERMAL_REG
+			// Cut the FET just enough to hold TEMP_CEIL, for as long as the host
+			// sheds the heat.  Turbo and solid modes run at most at fet_max.
+			fet_max = thermal_reg(get_temp());
+#else
+			heat += FET_LVL - (heat >> HEAT_DECAY_SHIFT); // Whatever the FET ran at during the last tick
+			if (heat > HEAT_LIMIT && FET_LVL > HEAT_FET_MAX) {
+				// Too hot, and this level would only get hotter, so whatever the
+				// mode is, step down to TURBO_STEP_DOWN, a regular solid mode
+				mode_idx = TURBO_STEP_DOWN;
+				remember_mode(mode_idx, config);
 			}
+#endif
+
+			eepos = save_tick(ticks, mode_idx, config, eepos);
+			ticks++;
 		}
-*/
-		uint8_t output = modesNx[mode_idx];
-		switch (output) {
-			case SOS:
-				blink(3,10,255, 0);
-				_delay_10_ms(20);
-				blink(3,20,255, 0);
-				blink(3,10,255, 0);
-				_delay_s();
-			break;
 
+		kind = pgm_read_byte(&mode_kind[mode_idx]);
+
+#ifdef PWM_PER_MODE
+		pwm_mode = pgm_read_byte(&mode_pwm[mode_idx]); // Switched over at the next Timer0 overflow
+#endif
+		switch (kind) {
 			case BATTCHECK:
+#ifdef BATT_VOLTS
+				// Tenths of a volt from VOLTS_MIN - 1 up, then split into the two digits
+				for (i=0; i < VOLTS_CNT && voltage >= pgm_read_word(&volts_table[i]); i++) {}
+				i += VOLTS_MIN - 1;
+				{
+					uint8_t volts = 0;
+					while (i >= 10) {
+						i -= 10;
+						volts++;
+					}
+					blink_num(volts);
+					blink_num(i);
+				}
+				_sleep_10_ms(100);
+#else
 				// figure out how many times to blink
-				for (i=0; voltage > voltage_blinks[i]; i++) {}
+				for (i=0; voltage > pgm_read_word(&voltage_blinks[i]); i++) {}
 				// blink zero to five times to show voltage
 				// (~0%, ~25%, ~50%, ~75%, ~100%, >100%)
 				blink(i, 10, BLINK_BRIGHTNESS);
 				// wait between readouts
-				_delay_s();
+				_sleep_10_ms(100);
+#endif
 			break;
 
-			case BEACON:
-				// Double blink low(ish) power beacon
-				blink(2, 7, 0, 255);  //Use regulator for better battery life
-				_delay_10_ms(255);
+#ifdef USAGE_LOG
+			case USAGE: {
+				// Hours lit, then energy used in 0.1Ah
+				uint16_t mah = usage_read(USAGE_MAH);
+				uint16_t dah = 0;
+				while (mah >= 100) {
+					mah -= 100;
+					dah++;
+				}
+				blink_num(usage_hours());
+				_sleep_10_ms(100);
+				blink_num(dah);
+				_sleep_10_ms(200);
+			}
 			break;
-
-			case STROBE:
-				// 10Hz strobe
-				blink(4, 2, 255, 0);
+#endif
+
+			case TURBO:
+#ifdef THERMAL_REG
+				set_output(fet_max, 0);
+#else
+				set_output(TURBO_OUTPUT); // Until the heat model finds it too hot
+#endif
 			break;
 
-			case BIKING_STROBE:
-				// Better two level beacon for biking and visibility
-				for(i=0;i<4;i++){
-					set_output(255, 0);
-					_delay_ms(5);
-					set_output(56, 255);
-					_delay_ms(65);
+			case SOLID: {
+				// Regular non-hidden solid mode, ramp there after step-downs and blinks
+				uint8_t fet = fet_comp(pgm_read_byte(&modesNx[mode_idx]), voltage);
+#ifdef THERMAL_REG
+				if (fet > fet_max) {
+					fet = fet_max;
+				}
+#endif
+				ramp_to(fet, pgm_read_byte(&modes1x[mode_idx]));
+#ifdef DITHER
+				if (dither_base != 255) { // There's no step above 255, dither_base + 1 would wrap to off
+					dither_frac = pgm_read_byte(&modes1xfrac[mode_idx]) << (8 - DITHER_BITS);
 				}
-				_delay_10_ms(72);
+#endif
+			}
 			break;
 
 			default:
-				// Do some magic here to handle turbo step-down
-				if ((output == TURBO) && (ticks > TURBO_TIMEOUT)) {
-					// step down to TURBO_STEP_DOWN
-					mode_idx = TURBO_STEP_DOWN;
-					eepos = save_mode_idx(mode_idx, config, eepos);
-				}
-				// Regular non-hidden solid mode
-				set_output(modesNx[mode_idx], modes1x[mode_idx]);
-				set_lock(config);
-				_delay_s();
-			break;
+				// Strobes, beacons and SOS
+				pattern_run((const uint8_t *)pgm_read_word(&patterns[kind - PATTERN]));
+			continue;            // The step has been idled out already
 		}
-		// If we got this far, the user has stopped fast-pressing.
-		// So, don't enter config mode.
-		ticks++;
-	//	fast_presses = 0;
+
+		if ((config & LOCK_MODE) && kind <= TURBO && timer_due(T_LOCK)) { // Solid modes and turbo
+			locked_in = 1;       // Lock the output
+		}
+
+		_delay_5_ms(1);          // Idle until the clock moves on
 	}
-}
\ No newline at end of file
+}
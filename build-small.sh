@@ -0,0 +1,34 @@
+#!/usr/bin/env bash
+
+# Like build.sh, but built for flash size: the whole program optimized as one,
+# unused sections dropped, linker relaxation and crt-small.S in place of
+# avr-libc's start-up.  Prints what every function and table costs.
+#
+# usage: ./build-small.sh blf-a6-rmm attiny13
+
+iname=$1
+mcu=$2
+oname="${iname}-${mcu}-small"
+
+mcuvar=$(echo ${mcu} | egrep -o '[0-9]{1,3}')
+
+# -fwhole-program makes the remaining globals local, main and the ISRs aside,
+# so the unused ones go, like the attiny13's T_LOCK slot of timer_at[]
+cflags="-Os -flto -fwhole-program -ffunction-sections -fdata-sections -mrelax -D CRT_SMALL"
+ldflags="-nostartfiles -Wl,--gc-sections"
+
+avr-gcc -Wall -mmcu=${mcu} -D ATTINY=${mcuvar} ${cflags} ${ldflags} -o ${oname}.elf crt-small.S ${iname}.c && avr-size -C ${oname}.elf || exit 1
+avr-objcopy -j .text -j .data -O ihex ${oname}.elf ${oname}.hex
+
+# Flash taken by each symbol, code and PROGMEM tables (t) and .data initializers (d), largest last
+echo "${oname}: bytes of flash per symbol"
+avr-nm --size-sort -S --radix=d ${oname}.elf | awk '$3 ~ /^[tTdD]$/ { printf "%6d %s %s\n", $2, $3, $4 }'
+
+# Flash left for features like the config menu
+case ${mcuvar} in
+	13) flash=1024 ;;
+	25) flash=2048 ;;
+	85) flash=8192 ;;
+esac
+used=$(avr-size -A ${oname}.elf | awk '$1 == ".text" || $1 == ".data" { s += $2 } END { print s }')
+echo "${oname}: ${used} of ${flash} bytes flash used, $((flash - used)) bytes headroom"
@@ -8,5 +8,14 @@ oname="${iname}-${mcu}"
 
 mcuvar=$(echo ${mcu} | egrep -o '[0-9]{1,3}')
 
-avr-gcc -Wall -Os -mmcu=${mcu} -D ATTINY=${mcuvar} -o ${oname}.elf ${iname}.c && avr-size -C ${oname}.elf
+avr-gcc -Wall -Os -mmcu=${mcu} -D ATTINY=${mcuvar} -o ${oname}.elf ${iname}.c && avr-size -C ${oname}.elf || exit 1
 avr-objcopy -j .text -j .data -O ihex ${oname}.elf ${oname}.hex
+
+# Flash left for features like the config menu
+case ${mcuvar} in
+	13) flash=1024 ;;
+	25) flash=2048 ;;
+	85) flash=8192 ;;
+esac
+used=$(avr-size -A ${oname}.elf | awk '$1 == ".text" || $1 == ".data" { s += $2 } END { print s }')
+echo "${oname}: ${used} of ${flash} bytes flash used, $((flash - used)) bytes headroom"
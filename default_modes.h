@@ -7,38 +7,171 @@
 #define NUM_MODES   8
 #define MODESNx1    0  ,0  ,0  ,7  ,56 ,90 ,137,255      //(FET or Nx7135)
 #define MODES1x1    8  ,20 ,110,255,255,255,255,0		  //(1x7135)
+// Fraction of a 7135 step added to MODES1x1 with DITHER, in 1/(1 << DITHER_BITS).
+// 8,0 is the stock moon, 2,8 would be 2.5/255 for a moon that runs for weeks.
+// A fraction on a 255 level is ignored, there's no step above it.
+#define MODES1xFRAC1 0  ,0  ,0  ,0  ,0  ,0  ,0  ,0
+// PWM waveform per mode with PWM_PER_MODE.  PHASE pulses are twice as long at
+// the same duty, which the 7135 needs to regulate at moon.  FAST runs at twice
+// the frequency, out of the whine band of the FET.  Hidden modes run PHASE.
+#define MODESPWM1   PHASE,PHASE,PHASE,FAST,FAST,FAST,FAST,FAST
 
 #define MODE1INC 1
 #define MODE2INC 2
 
 // Hidden modes are *after* the normal modes
+#ifdef USAGE_LOG
+#define NUM_HIDDEN       7
+#define HIDDENMODES      BATTCHECK,USAGE,TURBO,BIKING_STROBE,BEACON,STROBE,SOS
+#else
 #define NUM_HIDDEN       6
 #define HIDDENMODES      BATTCHECK,TURBO,BIKING_STROBE,BEACON,STROBE,SOS
-#define HIDDENMODES_ALT  0,0,0,0,0,0   // zeros, same length as NUM_HIDDEN
-
-#define TURBO         255 // Convenience code for turbo mode
-#define BATTCHECK     254 // Convenience code for battery check mode
-#define STROBE        253 // Convenience code for strobe mode
-#define BIKING_STROBE 252 // Convenience code for biking strobe mode
-#define SOS           251 // Convenience code for SOS mode
-#define BEACON        250 // Convenience code for beacon mode
-
-// How many timer ticks before before dropping down.
-// Each timer tick is 1s, so "30" would be a 30-second step down.
-// Max value of 255 unless you change "ticks"
-#define TURBO_TIMEOUT 30
+#endif
+
+// Mode kinds, kept apart from the output levels so every PWM value is usable
+#define SOLID         0 // Output levels from modesNx/modes1x, all normal modes are solid
+#define TURBO         1 // TURBO_OUTPUT, until the heat limit
+#define BATTCHECK     2 // Blinks out the battery level
+#define USAGE         3 // Blinks out hours lit and 0.1Ah used, with USAGE_LOG
+#define STROBE        4 // Kinds from here on play patterns[kind - PATTERN]
+#define BIKING_STROBE 5
+#define SOS           6
+#define BEACON        7
+#define PATTERN       STROBE
+
+// Without a temperature sensor turbo steps down when a heat model passes HEAT_LIMIT.
+// Each timer tick (1s) adds the FET level and loses 1/2^HEAT_DECAY_SHIFT of the heat,
+// so a level settles at level << HEAT_DECAY_SHIFT.  The model lives in RAM that
+// survives short presses, so turbo time can't be restarted by tapping out and back.
+// Any mode running the FET above HEAT_FET_MAX, the level that settles at the limit,
+// drops to TURBO_STEP_DOWN once it's hit, so its FET level has to be at most that.
+// 5 and 4900 step down after about 30s from cold.
+#ifndef THERMAL_REG
+#define HEAT_MODEL        // The temperature sensor does it properly where there is one
+#endif
+#define HEAT_DECAY_SHIFT 5
+#define HEAT_LIMIT    4900
+#define HEAT_FET_MAX  (HEAT_LIMIT >> HEAT_DECAY_SHIFT)
+// Main loop software timers, in clock_5ms ticks.  Each runs on its own,
+// whatever the mode is doing.  The clock keeps counting while the MCU is
+// powered down in the dark phases of blinky modes and readouts.
+#define BAT_PERIOD    CLOCK_MS(1000) // Battery sampling, LVP, the heat model and the mode save tick
+#define LOCK_TIME     CLOCK_MS(2550) // Solid modes and turbo lock in after this, with LOCK_MODE
+// How many timer ticks a mode has to be held before it's saved to EEPROM.
+// Until then it's only kept in RAM, which survives short and medium presses.
+#define SAVE_DELAY 2
 // Turbo step down mode index
 #define TURBO_STEP_DOWN (NUM_MODES - 2)
 
 #define MODE_CNT (NUM_MODES + NUM_HIDDEN - 1) // Subtract 1 since mode_idx starts at 0
 
+// Slew between solid mode levels instead of jumping, for step-downs and,
+// with RAMP_ON_ENTRY, also when the light comes on.  Both channels walk
+// along ramp_curve[] one entry per RAMP_STEP_MS, a full range ramp takes
+// RAMP_STEPS * RAMP_STEP_MS.
+//#define RAMPING
+//#define RAMP_ON_ENTRY
+#if (ATTINY == 85)          // The attiny85 has the flash to spare
+#define RAMPING
+#endif
+#define RAMP_STEP_MS  15    // Multiple of 5
+#define RAMP_STEPS    32
+
 // Output to use for blinks on battery check/config modes
 // (FET PWM level, Regulator PWM level)
 #define BLINK_BRIGHTNESS 0,20
+// Output of the turbo hidden mode
+#define TURBO_OUTPUT     255,0
+
+// Modes, output levels are only kept for the normal modes, which get the SOLID kind
+const uint8_t modesNx[NUM_MODES]      PROGMEM = { MODESNx1 };
+const uint8_t modes1x[NUM_MODES]      PROGMEM = { MODES1x1 };
+const uint8_t mode_kind[MODE_CNT + 1] PROGMEM = { [NUM_MODES] = HIDDENMODES };
+#ifdef DITHER
+const uint8_t modes1xfrac[NUM_MODES]  PROGMEM = { MODES1xFRAC1 };
+#endif
+#ifdef PWM_PER_MODE
+const uint8_t mode_pwm[MODE_CNT + 1]  PROGMEM = { MODESPWM1, [NUM_MODES ... MODE_CNT] = PHASE };
+#endif
+
+// FET modes hold their ADC_50 brightness as the cell drains.  FET current follows
+// (cell voltage - LED forward voltage), so the duty is scaled by comp_table[],
+// generated here from ADC_VF for 16 battery steps of 1 << COMP_SHIFT counts from
+// ADC_LOW up.  COMP_MAX (in 1/128) caps the boost on a low cell, levels are only
+// cut above ADC_50, and the top FET level (255) is left alone.
+//#define FET_COMP
+#if (ATTINY == 85)          // The attiny85 has the flash to spare
+#define FET_COMP
+#endif
+#define COMP_SHIFT    6
+#define COMP_MAX      160
+#define COMP_V(n)     (ADC_LOW_HR + ((n) << COMP_SHIFT) + (1 << (COMP_SHIFT - 1))) // Middle of step n
+#define COMP_RAW(n)   (COMP_V(n) > ADC_VF_HR ? 128L * (ADC_50_HR - ADC_VF_HR) / (COMP_V(n) > ADC_VF_HR ? COMP_V(n) - ADC_VF_HR : 1) : COMP_MAX)
+#define COMP(n)       ((uint8_t)(COMP_RAW(n) > COMP_MAX ? COMP_MAX : COMP_RAW(n))) // Cast, or a compiler may warn about the branch not taken
+
+#ifdef FET_COMP
+const uint8_t comp_table[16] PROGMEM = {
+	COMP(0),  COMP(1),  COMP(2),  COMP(3),  COMP(4),  COMP(5),  COMP(6),  COMP(7),
+	COMP(8),  COMP(9),  COMP(10), COMP(11), COMP(12), COMP(13), COMP(14), COMP(15)
+};
+#endif
 
-// Modes
-const uint8_t modesNx[] = { MODESNx1, HIDDENMODES };
-const uint8_t modes1x[] = { MODES1x1, HIDDENMODES_ALT };
+#ifdef RAMPING
+// Perceptually even PWM levels (gamma 2.2) that ramps step through
+const uint8_t ramp_curve[RAMP_STEPS] PROGMEM = {
+	0,   1,   2,   3,   4,   5,   7,   10,
+	13,  17,  21,  26,  32,  38,  44,  52,
+	60,  68,  77,  87,  97,  108, 120, 132,
+	145, 159, 173, 188, 204, 220, 237, 255
+};
+#endif
+
+// Blink patterns for the special modes, looped for as long as the mode is on.
+// Each step is FET level, 7135 level, duration in 5ms units (max 1275ms).
+// Steps with both levels at 0 power down instead of idling.
+// PAT_REPEAT(n, steps) plays the previous steps n times in total, repeats don't nest.
+#define PAT_MS(ms)           ((ms) / 5)
+#define PAT_REPEAT(n, steps) (n), 3 * ((steps) + 1), 0 // Bytes back to the first repeated step
+#define PAT_END              0, 0, 0
+
+const uint8_t pattern_strobe[] PROGMEM = {  // 10Hz strobe
+	255, 0,   PAT_MS(20),
+	0,   0,   PAT_MS(40),
+	PAT_REPEAT(4, 2),
+	PAT_END
+};
+const uint8_t pattern_biking[] PROGMEM = {  // Two level beacon for biking, with turbo flashes for visibility
+	255, 0,   PAT_MS(5),
+	56,  255, PAT_MS(65),
+	PAT_REPEAT(4, 2),
+	56,  255, PAT_MS(720),
+	PAT_END
+};
+const uint8_t pattern_sos[] PROGMEM = {     // ...---...
+	255, 0,   PAT_MS(100),
+	0,   0,   PAT_MS(200),
+	PAT_REPEAT(3, 2),
+	0,   0,   PAT_MS(200),
+	255, 0,   PAT_MS(200),
+	0,   0,   PAT_MS(400),
+	PAT_REPEAT(3, 2),
+	255, 0,   PAT_MS(100),
+	0,   0,   PAT_MS(200),
+	PAT_REPEAT(3, 2),
+	0,   0,   PAT_MS(1000),
+	PAT_END
+};
+const uint8_t pattern_beacon[] PROGMEM = {  // Double blink on the regulator for better battery life
+	0,   255, PAT_MS(70),
+	0,   0,   PAT_MS(140),
+	PAT_REPEAT(2, 2),
+	0,   0,   PAT_MS(1275),
+	0,   0,   PAT_MS(1275),
+	PAT_END
+};
+
+// Same order as the pattern kinds
+const uint8_t * const patterns[] PROGMEM = { pattern_strobe, pattern_biking, pattern_sos, pattern_beacon };
 
 // config / state variables
 // config bitfield
@@ -54,4 +187,26 @@ const uint8_t modes1x[] = { MODES1x1, HIDDENMODES_ALT };
 // Set the bit value of the config mode you'd like when starting fresh,
 // or when the config is wiped
 #define CONFIG_DEFAULT (CONFIG_SET + MEMORY + MED_PRESS) // 4 modes default
+
+// 16 fast presses enter the config menu.  It goes through config_menu[] in
+// order: blinks the option's number (1, 2, 3...), then buzzes with the option
+// toggled.  Turn the light off during the buzz to keep it toggled.  The last
+// one, CONFIG_SET, resets the config to CONFIG_DEFAULT.  The attiny13 has no
+// room for it, there the config is CONFIG_DEFAULT and nothing else.
+#if (ATTINY > 13)
+#define CONFIG_MENU
+#endif
+#ifdef CONFIG_MENU
+const uint8_t config_menu[] PROGMEM = { MUGGLE, MEMORY, MOON_MODE, MODE_DIR, MODE_GROUP, MED_PRESS, LOCK_MODE, CONFIG_SET };
+#endif
+
+// With CAP_CAL the menu has one more entry after config_menu[]: turn the
+// light off during its buzz and back on right away to learn this light's
+// press timing.  It blinks once: do a short press.  It blinks twice: do a
+// medium press.  A buzz means the thresholds were saved, 8 blinks that the
+// two presses were too close to tell apart.  A long press on the way cancels.
+//#define CAP_CAL
+#if defined(CAP_CAL) && !defined(CONFIG_MENU)
+#error "CAP_CAL is started from the config menu, enable CONFIG_MENU"
+#endif
 #endif /* DEFAULT_MODES_H_ */
\ No newline at end of file
@@ -1,66 +1,129 @@
 #ifndef DRIVER_H_
 #define DRIVER_H_
 // Required libraries
+#ifdef HOST
+// Native build of the mode logic (sim/uisim.c), only the settings below are used
+#include <stdint.h>
+#define PROGMEM
+#else
 #include <avr/pgmspace.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/eeprom.h>
 #include <avr/sleep.h>
 #include <avr/power.h>
+#include <avr/wdt.h>
 #include <util/delay_basic.h>
+#endif
 
 // Choose your MCU here, or in the build script
+#ifndef ATTINY
 #define ATTINY 13
 //#define ATTINY 25
 //#define ATTINY 85
+#endif
 
 // set some hardware-specific values...
 // (while configuring this firmware, skip this section)
 #if (ATTINY == 13)
 #define F_CPU 4800000UL
-#define EEPMODE 61
 #define EEPLEN 63
 #elif (ATTINY == 25)
 #define F_CPU 8000000UL
-#define EEPMODE 125
 #define EEPLEN 127
 #elif (ATTINY == 85)
 #define F_CPU 8000000UL
 // Saving space by limiting eeprom to 8 bit addressable space
-#define EEPMODE 253
 #define EEPLEN 255
 #else
 Hey, you need to define ATTINY.
 #endif
+// EEPROM from the top: the config byte at EEPLEN, press calibration in the
+// two cells below it, the usage log if there is one, then the mode ring.
+#define CAP_CAL_EEP (EEPLEN - 2) // CAP_MED, then CAP_SHORT, 0xFF when not calibrated
+#define EEPMODE (CAP_CAL_EEP - 1 - USAGE_LEN)
+#define EEP_GEN 0x40 // Generation bit of a mode ring cell, flips on every lap of the ring
 
 #if (ATTINY == 13)
 #define V_REF REFS0
+#define TIMSK_REG TIMSK0
 #elif (ATTINY == 25 || ATTINY == 85)
 #define V_REF REFS1
+#define TIMSK_REG TIMSK
 #endif
 
 /*
 * =========================================================================
 * Settings to modify per driver
 */
-//#define DEBUG
+//#define DEBUG            // Telemetry out of Star 3, see below
+
+#if (ATTINY == 25 || ATTINY == 85)
+// The FET pin is OC1A, so the FET can run on Timer1 clocked from the PLL.
+// The 7135 pin only has OC0A (/OC1A is just the inverse of OC1A), it stays on
+// Timer0, which also keeps the delay ticks.
+#define PLL_PWM
+#define PWM1_TOP    255     // OCR1C, FET levels are scaled to 0..PWM1_TOP
+#define PWM1_CLK    (1 << CS11) // PCK/2, 62.5kHz at TOP 255 from the 32MHz low speed PLL
+#endif
 
 //#define FAST 0x23           // fast PWM channel 1 only
 //#define PHASE 0x21          // phase-correct PWM channel 1 only
+#ifdef PLL_PWM
+#define FAST 0x83           // fast PWM on the 7135 only, the FET is on Timer1
+#define PHASE 0x81          // phase-correct PWM on the 7135 only
+#else
 #define FAST 0xA3           // fast PWM both channels
 #define PHASE 0xA1          // phase-correct PWM both channels
+#endif
 
-#define OWN_DELAY           // Should we use the built-in delay or our own?
-// Adjust the timing per-driver, since the hardware has high variance
-// Higher values will run slower, lower values run faster.
-#if (ATTINY == 13)
-#define DELAY_TWEAK         950
-#define DELAY_TWEAK_10ms    9500
-#elif (ATTINY == 25 || ATTINY == 85)
-#define DELAY_TWEAK         2000
-#define DELAY_TWEAK_10ms    19000
+//#define DARK_SLEEP        // Power down on the watchdog while the output is off
+//#define PWM_PER_MODE      // Each mode picks FAST or PHASE PWM from mode_pwm[]
+//#define DITHER            // Sub-step 7135 levels from modes1xfrac[]
+//#define USAGE_LOG         // Keep minutes per mode and mAh used in EEPROM
+//#define BATT_VOLTS        // Battery check blinks volts, then tenths, instead of 0-5 blinks
+//#define LVP_RECOVERY      // Cut off below ADC_CRIT too, come back on when the cell recovers, see below
+//#define ADC_OVERSAMPLE    // Battery readings sum ADC_SAMPLES conversions taken asleep, instead of one
+#if (ATTINY == 85)          // The attiny85 has the flash to spare for these
+#define DARK_SLEEP
+#define LVP_RECOVERY
+#define PWM_PER_MODE
+#endif
+#if (ATTINY == 25 || ATTINY == 85)
+#define ADC_OVERSAMPLE      // Nearly free next to THERMAL_REG, which sleeps through its conversions too
+#endif
+#define DITHER_BITS 4       // Fraction bits, the sequence repeats every 1 << DITHER_BITS overflows
+
+#ifdef USAGE_LOG
+// The usage log sits between the mode ring and the config byte, the ring
+// gives up the room.  Counters are 16-bit, stored inverted so that erased
+// cells read as 0: minutes lit for each of USAGE_SLOTS modes (modes past the
+// last slot share it), then the mAh used.  Usage is collected in RAM and
+// written every USAGE_FLUSH minutes or when the mode changes, so a counter
+// byte lasts USAGE_FLUSH x 100k minutes of use in that mode.  RAM survives
+// short and medium presses, a long press loses what wasn't written yet.
+#define USAGE_SLOTS   9
+#define USAGE_FLUSH   8     // Minutes, at most 15 so the buffered mA-minutes fit 16 bits
+#if USAGE_FLUSH > 15
+#error "USAGE_FLUSH over 15 minutes can overflow usage_mamin"
+#endif
+#define USAGE_LEN     (2 * USAGE_SLOTS + 2)
+#define USAGE_EEP     (EEPMODE + 1)
+#define USAGE_MAH     (USAGE_EEP + 2 * USAGE_SLOTS)
+#define USAGE_FET_MA  4000  // LED current with the FET fully on
+#define USAGE_7135_MA 350   // and with the 7135 fully on
+#else
+#define USAGE_LEN     0
 #endif
 
+// Timer0 runs phase-correct PWM with no prescaler, so it overflows once
+// every 510 clocks.  Delays count these overflows with the CPU in idle sleep.
+#define OVF_HZ              (F_CPU / 510)
+#define OVF_PER_MS          ((OVF_HZ + 500) / 1000)
+#define OVF_PER_5MS         ((OVF_HZ + 100) / 200)
+#define OVF_PER_10MS        ((OVF_HZ + 50) / 100)
+#define CLOCK_MS(ms)        ((ms) / 5)  // Milliseconds to clock_5ms ticks
+
 // These values were measured using wight's "A17HYBRID-S" driver built by DBCstm.
 // Your mileage may vary.
 #define ADC_100         170 // the ADC value for 100% full (4.2V resting)		178
@@ -70,13 +133,78 @@ Hey, you need to define ATTINY.
 #define ADC_0           128 // the ADC value for 0% full (3.0V resting)			128
 #define ADC_LOW         115 // When do we start ramping down (2.8V)				119
 #define ADC_CRIT        109 // When do we shut the light off (2.7V)				111
+#define ADC_VF          112 // The ADC value at the LED forward voltage, where FET current stops (2.75V)
+
+// Readings are the sum of ADC_SAMPLES 10-bit conversions, 4 samples give a
+// 12-bit scale, 16 times the 8-bit values above.  Replace these with values
+// measured in the 12-bit scale to get the full resolution.  Without
+// ADC_OVERSAMPLE one conversion is scaled up to the same range instead.
+#define ADC_SAMPLES     4
+#define ADC_HR(x)       ((x) << 4) // 8-bit value to the oversampled scale
+#define ADC_100_HR      ADC_HR(ADC_100)
+#define ADC_75_HR       ADC_HR(ADC_75)
+#define ADC_50_HR       ADC_HR(ADC_50)
+#define ADC_25_HR       ADC_HR(ADC_25)
+#define ADC_0_HR        ADC_HR(ADC_0)
+#define ADC_LOW_HR      ADC_HR(ADC_LOW)
+#define ADC_CRIT_HR     ADC_HR(ADC_CRIT)
+#define ADC_VF_HR       ADC_HR(ADC_VF)
+
+// BATT_VOLTS turns these calibration points (ADC value, volts * 10) into a
+// table of readings for every tenth from VOLTS_MIN up, interpolated between
+// the points and extrapolated past the ends.  Each entry is half a tenth
+// below its voltage, so the readout rounds to the nearest tenth.
+#define VOLTS_MIN       25
+#define VOLTS_CNT       20      // 2.5V to 4.4V
+#define VOLTS_SEG(h, a0, v0, a1, v1) \
+	(ADC_HR(a0) + (ADC_HR((a1) - (a0)) * ((h) - 2 * (v0)) + (v1) - (v0)) / (2 * ((v1) - (v0))))
+#define VOLTS_HR(h)     /* h in 1/20V */ \
+	((h) < 2 * 28 ? VOLTS_SEG(h, ADC_CRIT, 27, ADC_LOW, 28) : \
+	 (h) < 2 * 30 ? VOLTS_SEG(h, ADC_LOW, 28, ADC_0, 30) : \
+	 (h) < 2 * 35 ? VOLTS_SEG(h, ADC_0, 30, ADC_25, 35) : \
+	 (h) < 2 * 38 ? VOLTS_SEG(h, ADC_25, 35, ADC_50, 38) : \
+	 (h) < 2 * 40 ? VOLTS_SEG(h, ADC_50, 38, ADC_75, 40) : \
+	                VOLTS_SEG(h, ADC_75, 40, ADC_100, 42))
+#define VOLTS(n)        VOLTS_HR(2 * (VOLTS_MIN + (n)) - 1)
+
+// Low voltage protection steps down below ADC_LOW and shuts off for good at the
+// lowest mode.  With LVP_RECOVERY it also cuts off below ADC_CRIT, the step-down
+// count only resets once the cell is ADC_HYST above ADC_LOW again, and after a
+// cut off the light comes back on at moon once the cell is that far up too.
+#define ADC_HYST_HR     ADC_HR(4)
+#define LVP_RECHECKS    38  // Number of 8s watchdog wakeups to check for recovery before sleeping for good
+#define WDT_8S          9   // _sleep_wdt() period, 16ms << 9
+
+#if (ATTINY == 25 || ATTINY == 85)
+// Turbo and solid modes are held at TEMP_CEIL using the internal temperature
+// sensor instead of stepping down on the heat model, the FET is only cut as far
+// as needed.  The sensor reads about 1 count per degree C with ~275 counts at
+// 0C, and needs a per chip TEMP_OFFSET for any accuracy.
+#define THERMAL_REG
+#define TEMP_CHANNEL    0x0f    // MUX 1111 is the internal temperature sensor
+#define TEMP_OFFSET     0       // Sensor counts to add for this chip
+#define TEMP_CEIL       55      // Degrees C to regulate to
+#define TEMP_HR(c)      (((c) + 275 + TEMP_OFFSET) * ADC_SAMPLES) // Degrees C to an oversampled reading
+#define TEMP_CEIL_HR    TEMP_HR(TEMP_CEIL)
+#define TEMP_KP         2       // FET levels cut per oversampled count above the ceiling
+#define TEMP_KI_SHIFT   3       // Integral term is the summed error >> TEMP_KI_SHIFT
+#define TEMP_FET_MIN    90      // Lowest FET level the regulator goes down to
+#endif
 
 // the BLF EE A6 driver may have different offtime cap values than most other drivers
-// Values are between 1 and 255, and can be measured with offtime-cap.c
+// Values are between 1 and 255, and can be measured with offtime-cap.c, or
+// with CAP_CAL learned per light and kept at CAP_CAL_EEP instead.
 // These #defines are the edge boundaries, not the center of the target.
+// They are the stock values, read after a throw-away conversion at clk/64,
+// and get_cap() reads the cap that way unless CAP_CAL is on.  CAP_CAL keeps
+// the first conversion at clk/32 to light up sooner, and learns its own
+// thresholds through that path instead.
 #define CAP_SHORT           230  // Anything higher than this is a short press
 #define CAP_MED             120  // Between CAP_MED and CAP_SHORT is a medium press
 // Below CAP_MED is a long press
+#define CAP_SHORT_HR        ADC_HR(CAP_SHORT)
+#define CAP_MED_HR          ADC_HR(CAP_MED)
+#define CAP_CAL_MARGIN      16   // A calibration short press has to read this much above the medium one
 
 #define CAP_PIN     PB3
 #define CAP_CHANNEL 0x03    // MUX 03 corresponds with PB3 (Star 4)
@@ -87,32 +215,186 @@ Hey, you need to define ATTINY.
 #define ADC_CHANNEL 0x01    // MUX 01 corresponds with PB2
 #define ADC_DIDR    ADC1D   // Digital input disable bit corresponding with PB2
 #define ADC_PRSCL   0x06    // clk/64
+#define CAP_PRSCL   0x05    // clk/32, the CAP_CAL cap read only needs 8 bits and every us counts
+#ifdef PLL_PWM
+#define PWM_LVL     OCR1A   // OCR1A is the Timer1 output compare register for PB1
+#else
 #define PWM_LVL     OCR0B   // OCR0B is the output compare register for PB1
+#endif
+
+#ifdef DEBUG
+// TX-only 8N1 UART on Star 3, idle high.  Every record is four bytes:
+// 0xA5, a tag below, then a 16-bit value low byte first.
+#define DEBUG_PIN   PB4
+#define DEBUG_BAUD  9600
+#define DEBUG_BIT   ((F_CPU / DEBUG_BAUD - 12) / 4) // _delay_loop_2() counts, minus the bit loop
+#define DEBUG_SYNC  0xA5
+#define DBG_CAP     'C'     // get_cap() at boot, raw 12-bit
+#define DBG_MODE    'M'     // Resolved mode_idx at boot
+#define DBG_EEPOS   'E'     // Mode ring position at boot, and after every ring write
+#define DBG_BAT     'B'     // get_bat() every main loop pass, raw 12-bit
+#define DBG_TICKS   'T'     // ticks, every main loop pass
+#define DBG_LVP     'L'     // emergency_shutdown(), value is 0 going down, else the voltage it came back at
+#define DBG_STEP    'S'     // low_batt_stepdown(), value is the new mode_idx
+#endif
 #define ALT_PWM_LVL OCR0A   // OCR0A is the output compare register for PB0
 
 /*
 * =========================================================================
 */
 
+#ifndef HOST
+
+volatile uint8_t tick_ovf; // Timer0 overflows since the current delay step started
+volatile uint16_t clock_5ms; // Time base of the main loop timers, _sleep_wdt() adds what it slept
+uint8_t clock_ovf;
+
+#ifdef PWM_PER_MODE
+volatile uint8_t pwm_mode = PHASE; // TCCR0A wanted by the current mode
+uint8_t tick_odd;                  // Fast PWM overflows twice per tick
+#endif
+
+#ifdef DITHER
+volatile uint8_t dither_frac;      // Fraction of a step on top of dither_base, in 1/256
+uint8_t dither_base;               // 7135 level set by set_output()
+uint8_t dither_acc;
+#endif
+
+ISR(TIM0_OVF_vect) {
+#ifdef DITHER
+	if (dither_frac) {
+		// First order sigma-delta, one step up on the overflows where the
+		// accumulator carries, so the extra steps are spread evenly
+		uint8_t acc = dither_acc + dither_frac;
+		ALT_PWM_LVL = dither_base + (acc < dither_acc);
+		dither_acc = acc;
+	}
+#endif
+#ifdef PWM_PER_MODE
+	// Timer0 is at BOTTOM in both waveforms here, so switching now never
+	// cuts a PWM period short.  Fast PWM still pulses for a clock at OCR 0,
+	// so a channel that is off gets disconnected from its pin instead.
+	uint8_t wgm = pwm_mode;
+	if (wgm == FAST) {
+		if (!PWM_LVL) wgm &= ~(1 << COM0B1);
+		if (!ALT_PWM_LVL) wgm &= ~(1 << COM0A1);
+		tick_odd ^= 1;
+	} else {
+		tick_odd = 0;
+	}
+	TCCR0A = wgm;
+	if (tick_odd) return;           // 2x256 clocks is close enough to 510
+#endif
+	tick_ovf++;
+	if (++clock_ovf >= OVF_PER_5MS) {
+		clock_ovf = 0;
+		clock_5ms++;
+	}
+}
+
+static uint16_t clock_now()
+{
+	uint16_t t;
+	cli();
+	t = clock_5ms;
+	sei();
+	return t;
+}
+
+// Idle until ovf Timer0 overflows have passed, PWM keeps running meanwhile
+static void _delay_ovf(uint8_t ovf)
+{
+	tick_ovf = 0;
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	while (tick_ovf < ovf) sleep_mode();
+}
+
+#ifdef DARK_SLEEP
+static void _delay_ms(uint8_t n)
+{
+	while(n-- > 0) _delay_ovf(OVF_PER_MS);
+}
+#endif
 
-void _delay_ms(uint8_t n)
+// Max delay time 1275ms
+static void _delay_5_ms(uint8_t n)
 {
-	// TODO: make this take tenths of a ms instead of ms,
-	// for more precise timing?
-	while(n-- > 0) _delay_loop_2(DELAY_TWEAK);
+	while(n-- > 0) _delay_ovf(OVF_PER_5MS);
 }
-//void _delay_s()  // because it saves a bit of ROM space to do it this way
-//{
-//	_delay_ms(1000);
-//}
 
 // Max delay time 2550ms
-void _delay_10_ms(uint8_t n)
+static void _delay_10_ms(uint8_t n)
 {
-	while(n-- > 0) _delay_loop_2(DELAY_TWEAK_10ms);
+	while(n-- > 0) _delay_ovf(OVF_PER_10MS);
 }
-void _delay_s()  // because it saves a bit of ROM space to do it this way
+
+#if defined(DARK_SLEEP) || defined(LVP_RECOVERY)
+EMPTY_INTERRUPT(WDT_vect); // The watchdog is only used to wake us up
+
+// Set the watchdog to interrupt-only mode with the given WDTCR bits, 0 stops it
+static void wdt_set(uint8_t wdtcr)
 {
-	_delay_10_ms(100);
+	cli();
+	wdt_reset();
+	WDTCR = (1 << WDCE) | (1 << WDE); // Timed sequence, the next write must follow within 4 cycles
+	WDTCR = wdtcr;
+	sei();
 }
+
+// Power down for one watchdog period with the timer and ADC gated off.
+// wdp 0-9 gives 16ms << wdp.  Timer0 stops, so the period is added to
+// clock_5ms afterwards, 3.25 ticks per 16ms is as close as a shift gets
+// and well inside the watchdog oscillator's tolerance.
+// Only call this while both outputs are at 0.
+static void _sleep_wdt(uint8_t wdp)
+{
+	uint8_t tccr = TCCR0A;
+	TCCR0A = 0;                          // Hand the PWM pins back to PORTB, which holds them low
+	ADCSRA &= ~(1 << ADEN);              // ADC must be off before it's gated
+	power_all_disable();
+	wdt_set((1 << WDTIE) | (wdp & 7) | ((wdp & 8) ? (1 << WDP3) : 0));
+	set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+	sleep_enable();
+	sleep_bod_disable();                 // Has to come right before sleeping
+	sleep_cpu();
+	sleep_disable();
+	wdt_set(0);
+	clock_5ms += (13 << wdp) >> 2;       // Timer0 is still gated, nothing else writes it now
+	power_all_enable();
+	TCCR0A = tccr;                       // get_voltage() re-enables the ADC on its own
+}
+#endif
+
+#ifdef DARK_SLEEP
+
+// Sleep made of watchdog periods, the remainder below 16ms is idled away
+static void _sleep_ms(uint16_t ms)
+{
+	uint8_t wdp = 7; // 2048ms, the longest period used
+	do {
+		while (ms >= (16 << wdp)) {
+			_sleep_wdt(wdp);
+			ms -= (16 << wdp);
+		}
+	} while (wdp--);
+	_delay_ms(ms);
+}
+
+// Max sleep time 1275ms
+static void _sleep_5_ms(uint8_t n)
+{
+	_sleep_ms(n * 5);
+}
+
+// Max sleep time 2550ms
+static void _sleep_10_ms(uint8_t n)
+{
+	_sleep_ms(n * 10);
+}
+#else
+#define _sleep_10_ms _delay_10_ms
+#define _sleep_5_ms  _delay_5_ms
+#endif
+
+#endif /* HOST */
 #endif /* DRIVER_H_ */
\ No newline at end of file
@@ -0,0 +1,634 @@
+/*
+* simavr harness for measuring the firmware without a driver or a scope.
+*
+* Runs a firmware ELF on a simulated ATtiny, feeds it scripted values on the
+* off-time cap and battery ADC channels, and reports:
+*   - cycles from reset to the first PWM level write (power-on-to-light)
+*   - cycles spent in each call of the symbols given with -s
+*   - main loop passes through the -l address, with the cycles each one
+*     takes and how many of those the CPU was awake rather than sleeping
+*   - the OCR0B (FET, OCR1A on the 25/85) / OCR0A (1x7135) waveform,
+*     optionally checked against an expected pattern with -w
+*   - the effective duty of both channels, from the levels and the
+*     waveform (fast or phase correct) Timer0 runs while they are set,
+*     or Timer1's PLL PWM for the FET on the 25/85
+*   - the telemetry records of a DEBUG build, decoded from the Star 3 pin
+*   - every interrupt taken, per vector, and how many of them woke the CPU
+*   - with -i, whether the start-up code copied .data and cleared .bss
+*     before main, RAM starts out filled with garbage like on a real part
+*
+* Copyright (C) 2018 Ketturi
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+* Usage: simbench [options] firmware.elf
+*   -m mcu       attiny13 (default), attiny25 or attiny85
+*   -f hz        CPU frequency, defaults to 4800000 for attiny13, else 8000000
+*   -t seconds   simulated run time (default 10)
+*   -c value     off-time cap reading, 8-bit like CAP_SHORT (default 255, short press)
+*   -b value     battery reading, 8-bit like ADC_100 (default 170)
+*   -S file      ADC script, lines of "<ms> cap|bat <value>"
+*   -e idx       mode index stored in the EEPROM mode ring before reset
+*   -s name=addr report every call of a function, addr from avr-nm
+*   -l addr      a pass of the main loop starts when execution gets here
+*   -p           print every PWM segment as "<ms> <fet> <7135> <duration ms>",
+*                followed by the waveform and the effective fet and 7135 duty
+*   -o file      write every PWM level change as "<cycle>,<ocr0a>,<ocr0b>"
+*   -w file      expected waveform, lines of "<fet> <7135> <ms>", repeating
+*   -T percent   timing tolerance for -w (default 10)
+*   -u baud      DEBUG_BAUD of the firmware (default 9600)
+*   -i main:data_start:data_end:data_load:bss_end
+*                addresses from avr-nm, main and the linker's __data_start,
+*                __data_end, __data_load_start and __bss_end
+*
+* sim/simbench.sh builds the firmware and this harness and fills in -s, -l and -i.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sim_avr.h>
+#include <sim_elf.h>
+#include <sim_io.h>
+#include <avr_adc.h>
+#include <avr_timer.h>
+#include <avr_eeprom.h>
+#include <avr_ioport.h>
+#include <sim_cycle_timers.h>
+
+// Keep these in sync with driver.h
+#define CAP_CHANNEL 3
+#define ADC_CHANNEL 1
+#define EEP_GEN     0x40
+#define DEBUG_PIN   4
+#define DEBUG_SYNC  0xA5
+#define FAST_WGM    0x03    // WGM01 | WGM00 in TCCR0A
+#define FET_COM     0x20    // COM0B1, OCR0B drives the FET
+#define REG_COM     0x80    // COM0A1, OCR0A drives the 7135
+#define TCCR1       0x50    // Data space addresses of the Timer1 registers, 25/85 only
+#define OCR1C       0x4d
+#define PWM1_COM    0x20    // COM1A1, OCR1A drives the FET
+
+#define MAX_SYMS    8
+#define MAX_EVENTS  256
+#define MAX_WAVE    64
+#define MIN_SEGMENT_US 50 // Shorter segments are the gap between two OCR writes
+#define RAMSTART    0x60
+#define RAM_GARBAGE 0xA5    // Power-on RAM for -i, never equal to its own complement
+#define MAX_VECTORS 15
+
+static avr_t *avr;
+static double us_per_cycle;
+
+typedef struct {
+	const char *name;
+	avr_flashaddr_t addr;
+	uint16_t sp;        // Stack pointer at entry, 0 when not inside the call
+	avr_cycle_count_t start;
+	uint32_t calls;
+	avr_cycle_count_t total, worst;
+} sym_t;
+
+static sym_t syms[MAX_SYMS];
+static int nsyms;
+static avr_flashaddr_t loop_addr;
+static avr_cycle_count_t loop_last;   // Start of the current pass
+static avr_cycle_count_t awake;       // Cycles run, not slept, in the current pass
+static uint32_t loops;
+static avr_cycle_count_t loop_total, awake_total, awake_worst, worst_at;
+
+static const char * const vectors13[MAX_VECTORS] = {
+	"RESET", "INT0", "PCINT0", "TIM0_OVF", "EE_RDY", "ANA_COMP", "TIM0_COMPA", "TIM0_COMPB", "WDT", "ADC"
+};
+static const char * const vectors85[MAX_VECTORS] = {
+	"RESET", "INT0", "PCINT0", "TIM1_COMPA", "TIM1_OVF", "TIM0_OVF", "EE_RDY", "ANA_COMP", "ADC",
+	"TIM1_COMPB", "TIM0_COMPA", "TIM0_COMPB", "WDT", "USI_START", "USI_OVF"
+};
+static const char * const *vector_names;
+static uint32_t irqs[MAX_VECTORS], irq_wakes[MAX_VECTORS];
+
+static avr_flashaddr_t init_addr, data_load; // -i, main and where .data is kept in flash
+static uint16_t data_start, data_end, bss_end;
+static int init_state = -1;   // -1 until main is reached, then the number of bad bytes
+
+typedef struct {
+	avr_cycle_count_t cycle;
+	int channel;
+	uint8_t value;
+} adc_event_t;
+
+static adc_event_t events[MAX_EVENTS];
+static int nevents;
+
+typedef struct {
+	uint8_t fet, reg;
+	double ms;
+} segment_t;
+
+static segment_t wave[MAX_WAVE];
+static int nwave;
+static int wave_pos = -1; // -1 until the first expected segment is seen
+static uint32_t wave_ok, wave_bad;
+static double tolerance = 10;
+
+static uint8_t ocr[2];         // Current OCR0A, OCR0B
+static uint8_t seg_fet, seg_reg;
+static avr_cycle_count_t seg_start;
+static avr_cycle_count_t first_light;
+static uint16_t tccr0a;        // Data space address of TCCR0A
+static int fet_timer1;         // The FET is on Timer1 (25/85 with PLL_PWM)
+static double fet_duty_ms, reg_duty_ms, lit_ms; // For the time weighted duty
+static int print_segments;
+static FILE *trace;
+
+static uint32_t baud = 9600;
+static avr_cycle_count_t bit_cycles;
+static uint8_t tx_level;       // Last level written to DEBUG_PIN
+static int tx_bit = -1;        // Bit being received, -1 while idle
+static uint8_t tx_byte;
+static uint8_t rec[4];         // Telemetry record being put together
+static int rec_len;
+static uint32_t records, framing_errors;
+
+static uint16_t get_sp(void) {
+	return avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+}
+
+static double to_ms(avr_cycle_count_t cycles) {
+	return cycles * us_per_cycle / 1000.0;
+}
+
+// 8-bit reading with the 1.1V reference, in the middle of its 10-bit step
+static uint32_t to_mv(uint8_t value) {
+	return ((value << 2) + 2) * 1100 / 1024;
+}
+
+static void set_adc(int channel, uint8_t value) {
+	avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_ADC0 + channel), to_mv(value));
+}
+
+static void check_segment(uint8_t fet, uint8_t reg, double ms) {
+	if (!nwave) {
+		return;
+	}
+	if (wave_pos < 0) { // Sync up on the first expected segment
+		if (fet != wave[0].fet || reg != wave[0].reg) {
+			return;
+		}
+		wave_pos = 0;
+	}
+	segment_t *w = &wave[wave_pos];
+	double slack = w->ms * tolerance / 100.0;
+	if (fet == w->fet && reg == w->reg && ms >= w->ms - slack && ms <= w->ms + slack) {
+		wave_ok++;
+	} else {
+		wave_bad++;
+		printf("wave: expected %3d %3d %8.2f ms, got %3d %3d %8.2f ms\n",
+			w->fet, w->reg, w->ms, fet, reg, ms);
+	}
+	wave_pos = (wave_pos + 1) % nwave;
+}
+
+// Effective duty in percent of a channel.  Fast PWM is on from BOTTOM through
+// the match, phase correct between the matches on the way up and down.  The
+// firmware disconnects a channel at level 0 in fast PWM.
+static double duty(uint8_t wgm, uint8_t com, uint8_t level) {
+	if (!(wgm & com)) {
+		return 0;
+	}
+	if ((wgm & FAST_WGM) == FAST_WGM) {
+		return (level + 1) * 100.0 / 256;
+	}
+	return level * 100.0 / 255;
+}
+
+// Timer1 PWM sets OC1A at 0 and clears it on the match, a period is OCR1C + 1
+static double duty1(uint8_t level) {
+	uint8_t top = avr->data[OCR1C];
+	if (!(avr->data[TCCR1] & PWM1_COM)) {
+		return 0;
+	}
+	return level >= top ? 100.0 : (level + 1) * 100.0 / (top + 1);
+}
+
+// check is 0 for the segment the end of the run cuts short
+static void end_segment(int check) {
+	double ms = to_ms(avr->cycle - seg_start);
+	uint8_t wgm = avr->data[tccr0a]; // Still what the ending segment ran with
+	double fet = fet_timer1 ? duty1(seg_fet) : duty(wgm, FET_COM, seg_fet);
+	double reg = duty(wgm, REG_COM, seg_reg);
+	if (print_segments) {
+		printf("pwm %10.2f ms %3d %3d %8.2f ms %-5s %5.1f%% %5.1f%%\n", to_ms(seg_start), seg_fet, seg_reg, ms,
+			(wgm & FAST_WGM) == FAST_WGM ? "fast" : "phase", fet, reg);
+	}
+	if (first_light && seg_start >= first_light) {
+		fet_duty_ms += fet * ms;
+		reg_duty_ms += reg * ms;
+		lit_ms += ms;
+	}
+	if (check) {
+		check_segment(seg_fet, seg_reg, ms);
+	}
+}
+
+static void pwm_changed(struct avr_irq_t *irq, uint32_t value, void *param) {
+	int channel = (intptr_t)param;
+	ocr[channel] = value;
+
+	if (!first_light) {
+		first_light = avr->cycle;
+	}
+	if (trace) {
+		fprintf(trace, "%llu,%d,%d\n", (unsigned long long)avr->cycle, ocr[0], ocr[1]);
+	}
+	if (ocr[1] == seg_fet && ocr[0] == seg_reg) {
+		return;
+	}
+	// Both registers are written back to back, don't report the gap as a segment
+	if (to_ms(avr->cycle - seg_start) * 1000.0 >= MIN_SEGMENT_US) {
+		end_segment(1);
+		seg_start = avr->cycle;
+	}
+	seg_fet = ocr[1];
+	seg_reg = ocr[0];
+}
+
+// A whole telemetry record came in, see DBG_* in driver.h for the tags
+static void print_record(void) {
+	uint16_t value = rec[2] | (rec[3] << 8);
+	records++;
+	printf("dbg %10.2f ms %c %5u", to_ms(avr->cycle), rec[1], value);
+	switch (rec[1]) {
+		case 'C':
+		case 'B': printf(" (8-bit %u, %u mV at the pin)", value >> 4, to_mv(value >> 4)); break;
+		case 'L': printf(value ? " (back on)" : " (shutdown)"); break;
+	}
+	printf("\n");
+}
+
+static void rx_byte(uint8_t b) {
+	if (!rec_len && b != DEBUG_SYNC) { // Resync on the next 0xA5
+		return;
+	}
+	rec[rec_len++] = b;
+	if (rec_len == sizeof(rec)) {
+		print_record();
+		rec_len = 0;
+	}
+}
+
+// Samples DEBUG_PIN in the middle of every bit after a start bit
+static avr_cycle_count_t rx_sample(struct avr_t *a, avr_cycle_count_t when, void *param) {
+	if (tx_bit == 0 && tx_level) { // Start bit gone already, a glitch
+		tx_bit = -1;
+		return 0;
+	}
+	if (tx_bit >= 1 && tx_bit <= 8) {
+		tx_byte = (tx_byte >> 1) | (tx_level ? 0x80 : 0);
+	}
+	if (tx_bit == 9) {
+		if (tx_level) {
+			rx_byte(tx_byte);
+		} else {
+			framing_errors++;
+		}
+		tx_bit = -1;
+		return 0;
+	}
+	tx_bit++;
+	return when + bit_cycles;
+}
+
+static void tx_changed(struct avr_irq_t *irq, uint32_t value, void *param) {
+	if (tx_level && !value && tx_bit < 0) { // Falling edge of a start bit
+		tx_bit = 0;
+		avr_cycle_timer_register(avr, bit_cycles / 2, rx_sample, NULL);
+	}
+	tx_level = value;
+}
+
+static void track_calls(void) {
+	for (int i = 0; i < nsyms; i++) {
+		sym_t *s = &syms[i];
+		if (s->sp && get_sp() > s->sp) { // Returned
+			avr_cycle_count_t c = avr->cycle - s->start;
+			s->calls++;
+			s->total += c;
+			if (c > s->worst) {
+				s->worst = c;
+			}
+			printf("call %-16s #%-4u at %10.2f ms: %8llu cycles\n",
+				s->name, s->calls, to_ms(s->start), (unsigned long long)c);
+			s->sp = 0;
+		}
+		if (!s->sp && avr->pc == s->addr) { // Entered, the return address is already on the stack
+			s->sp = get_sp();
+			s->start = avr->cycle;
+		}
+	}
+}
+
+// A pass goes from one visit of loop_addr to the next, sleeps included
+static void track_loop(void) {
+	if (!loop_addr || avr->pc != loop_addr) {
+		return;
+	}
+	if (loop_last) {
+		loops++;
+		loop_total += avr->cycle - loop_last;
+		awake_total += awake;
+		if (awake > awake_worst) {
+			awake_worst = awake;
+			worst_at = loop_last;
+		}
+	}
+	loop_last = avr->cycle;
+	awake = 0;
+}
+
+// An interrupt pushed the return address and jumped to its vector slot.  Only
+// checking the slot isn't enough, crt-small.S starts its code in the slots
+// past the last vector it uses.
+static void track_irq(int woke, uint16_t sp) {
+	unsigned n = avr->pc / 2;
+	if (!avr->pc || avr->pc & 1 || n >= MAX_VECTORS || !vector_names[n] || get_sp() != sp - 2) {
+		return;
+	}
+	irqs[n]++;
+	if (woke) {
+		irq_wakes[n]++;
+	}
+}
+
+// The first time main is entered, .data has to hold its load image and .bss
+// has to be all zeros, nothing else has written RAM yet
+static void check_init(void) {
+	if (!init_addr || init_state >= 0 || avr->pc != init_addr) {
+		return;
+	}
+	init_state = 0;
+	for (uint16_t a = data_start; a < bss_end; a++) {
+		uint8_t want = a < data_end ? avr->flash[data_load + a - data_start] : 0;
+		if (avr->data[a] != want) {
+			if (init_state++ < 8) {
+				printf("start-up: %s byte at 0x%04x is 0x%02x, not 0x%02x\n",
+					a < data_end ? ".data" : ".bss", a, avr->data[a], want);
+			}
+		}
+	}
+	printf("start-up: main entered at %llu cycles, .data %u bytes, .bss %u bytes, %d wrong\n",
+		(unsigned long long)avr->cycle, data_end - data_start, bss_end - data_end, init_state);
+}
+
+static int load_script(const char *file, double freq) {
+	FILE *f = fopen(file, "r");
+	char line[128], what[8];
+	double ms;
+	unsigned value;
+
+	if (!f) {
+		perror(file);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) && nevents < MAX_EVENTS) {
+		if (line[0] == '#' || sscanf(line, "%lf %7s %u", &ms, what, &value) != 3) {
+			continue;
+		}
+		events[nevents].cycle = ms * freq / 1000.0;
+		events[nevents].channel = strcmp(what, "cap") ? ADC_CHANNEL : CAP_CHANNEL;
+		events[nevents].value = value;
+		nevents++;
+	}
+	fclose(f);
+	return 0;
+}
+
+static int load_wave(const char *file) {
+	FILE *f = fopen(file, "r");
+	char line[128];
+	unsigned fet, reg;
+	double ms;
+
+	if (!f) {
+		perror(file);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) && nwave < MAX_WAVE) {
+		if (line[0] == '#' || sscanf(line, "%u %u %lf", &fet, &reg, &ms) != 3) {
+			continue;
+		}
+		wave[nwave].fet = fet;
+		wave[nwave].reg = reg;
+		wave[nwave].ms = ms;
+		nwave++;
+	}
+	fclose(f);
+	return 0;
+}
+
+static void usage(const char *self) {
+	fprintf(stderr, "usage: %s [-m mcu] [-f hz] [-t s] [-c cap] [-b bat] [-S script] [-e idx]\n"
+		"\t[-s name=addr]... [-l addr] [-p] [-o trace] [-w wave] [-T percent]\n"
+		"\t[-i main:data_start:data_end:data_load:bss_end] firmware.elf\n", self);
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	const char *mcu = "attiny13";
+	double freq = 0, seconds = 10;
+	int cap = 255, bat = 170, mode = -1;
+	const char *script = NULL, *wavefile = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:f:t:c:b:S:e:s:l:po:w:T:u:i:")) != -1) {
+		switch (opt) {
+			case 'm': mcu = optarg; break;
+			case 'f': freq = atof(optarg); break;
+			case 't': seconds = atof(optarg); break;
+			case 'c': cap = atoi(optarg); break;
+			case 'b': bat = atoi(optarg); break;
+			case 'S': script = optarg; break;
+			case 'e': mode = atoi(optarg); break;
+			case 's': {
+				char *eq = strchr(optarg, '=');
+				if (!eq || nsyms == MAX_SYMS) {
+					usage(argv[0]);
+				}
+				*eq = 0;
+				syms[nsyms].name = optarg;
+				syms[nsyms].addr = strtoul(eq + 1, NULL, 0);
+				nsyms++;
+				break;
+			}
+			case 'l': loop_addr = strtoul(optarg, NULL, 0); break;
+			case 'p': print_segments = 1; break;
+			case 'o':
+				if (!(trace = fopen(optarg, "w"))) {
+					perror(optarg);
+					return 1;
+				}
+				break;
+			case 'w': wavefile = optarg; break;
+			case 'T': tolerance = atof(optarg); break;
+			case 'u': baud = atoi(optarg); break;
+			case 'i': {
+				unsigned long a[5];
+				if (sscanf(optarg, "%li:%li:%li:%li:%li", &a[0], &a[1], &a[2], &a[3], &a[4]) != 5) {
+					usage(argv[0]);
+				}
+				init_addr = a[0];
+				data_start = a[1] & 0xffff; // avr-nm has RAM at 0x800000
+				data_end = a[2] & 0xffff;
+				data_load = a[3];
+				bss_end = a[4] & 0xffff;
+				break;
+			}
+			default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+	}
+	if (!freq) {
+		freq = strcmp(mcu, "attiny13") ? 8000000 : 4800000;
+	}
+	if ((script && load_script(script, freq)) || (wavefile && load_wave(wavefile))) {
+		return 1;
+	}
+
+	elf_firmware_t f;
+	memset(&f, 0, sizeof(f));
+	if (elf_read_firmware(argv[optind], &f)) {
+		fprintf(stderr, "%s: can't read firmware\n", argv[optind]);
+		return 1;
+	}
+	strncpy(f.mmcu, mcu, sizeof(f.mmcu) - 1);
+	f.frequency = freq;
+
+	if (!(avr = avr_make_mcu_by_name(mcu))) {
+		fprintf(stderr, "%s: unknown mcu\n", mcu);
+		return 1;
+	}
+	avr_init(avr);
+	avr_load_firmware(avr, &f);
+	us_per_cycle = 1e6 / freq;
+	tccr0a = strcmp(mcu, "attiny13") ? 0x4a : 0x4f;
+	bit_cycles = freq / baud;
+	vector_names = strcmp(mcu, "attiny13") ? vectors85 : vectors13;
+	if (init_addr) {
+		if (data_start < RAMSTART || data_end < data_start || bss_end < data_end || bss_end > avr->ramend) {
+			fprintf(stderr, "-i: .data/.bss at 0x%04x-0x%04x-0x%04x aren't in RAM\n", data_start, data_end, bss_end);
+			return 1;
+		}
+		memset(avr->data + RAMSTART, RAM_GARBAGE, avr->ramend + 1 - RAMSTART);
+	}
+
+	if (mode >= 0) { // First lap of the ring, everything else erased
+		uint8_t ee[64];
+		memset(ee, 0xff, sizeof(ee));
+		ee[0] = mode & ~EEP_GEN;
+		avr_eeprom_desc_t d = { .ee = ee, .offset = 0, .size = sizeof(ee) };
+		avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &d);
+	}
+
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_TIMER_GETIRQ('0'), TIMER_IRQ_OUT_PWM0),
+		pwm_changed, (void *)0);
+	// With PLL_PWM the FET is OCR1A, the 25/85 builds always have it
+	fet_timer1 = strcmp(mcu, "attiny13") != 0;
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_TIMER_GETIRQ(fet_timer1 ? '1' : '0'),
+		fet_timer1 ? TIMER_IRQ_OUT_PWM0 : TIMER_IRQ_OUT_PWM1), pwm_changed, (void *)1);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), DEBUG_PIN),
+		tx_changed, NULL);
+
+	set_adc(CAP_CHANNEL, cap);
+	set_adc(ADC_CHANNEL, bat);
+
+	avr_cycle_count_t end = seconds * freq;
+	int next_event = 0;
+	int state = cpu_Running;
+	while (avr->cycle < end && state != cpu_Done && state != cpu_Crashed) {
+		while (next_event < nevents && events[next_event].cycle <= avr->cycle) {
+			set_adc(events[next_event].channel, events[next_event].value);
+			next_event++;
+		}
+		avr_cycle_count_t before = avr->cycle;
+		uint16_t sp = get_sp();
+		int running = avr->state == cpu_Running;
+		state = avr_run(avr);
+		if (running) {
+			awake += avr->cycle - before;
+		}
+		track_irq(!running, sp);
+		check_init();
+		track_calls();
+		track_loop();
+	}
+	end_segment(0);
+
+	printf("\n");
+	if (first_light) {
+		printf("boot to light: %llu cycles (%.3f ms)\n",
+			(unsigned long long)first_light, to_ms(first_light));
+	} else {
+		printf("boot to light: output never set\n");
+	}
+	for (int i = 0; i < nsyms; i++) {
+		sym_t *s = &syms[i];
+		if (s->calls) {
+			printf("%-16s %4u calls, avg %8llu cycles, worst %8llu cycles (%.3f ms)\n",
+				s->name, s->calls, (unsigned long long)(s->total / s->calls),
+				(unsigned long long)s->worst, to_ms(s->worst));
+		} else {
+			printf("%-16s never called\n", s->name);
+		}
+	}
+	if (loops) {
+		printf("main loop        %4u passes, avg %8llu cycles, awake avg %6llu cycles\n"
+			"                 worst awake %llu cycles (%.3f ms) in the pass at %.2f ms\n",
+			loops, (unsigned long long)(loop_total / loops), (unsigned long long)(awake_total / loops),
+			(unsigned long long)awake_worst, to_ms(awake_worst), to_ms(worst_at));
+	} else if (loop_addr) {
+		printf("main loop        never got around\n");
+	}
+	if (lit_ms > 0) {
+		printf("effective duty   fet %5.1f%%, 7135 %5.1f%% averaged after first light\n",
+			fet_duty_ms / lit_ms, reg_duty_ms / lit_ms);
+	}
+	for (int i = 1; i < MAX_VECTORS; i++) {
+		if (irqs[i]) {
+			printf("interrupt %-10s %8u taken, %u of them woke the CPU\n", vector_names[i], irqs[i], irq_wakes[i]);
+		}
+	}
+	if (init_addr && init_state < 0) {
+		printf("start-up: main never entered\n");
+	}
+	if (records || framing_errors) {
+		printf("telemetry        %4u records, %u framing errors\n", records, framing_errors);
+	}
+	if (nwave) {
+		printf("waveform         %4u segments ok, %u off spec\n", wave_ok, wave_bad);
+	}
+	if (trace) {
+		fclose(trace);
+	}
+	if (state == cpu_Crashed) {
+		printf("cpu crashed at pc 0x%04x\n", avr->pc);
+		return 1;
+	}
+	return (wave_bad || (init_addr && init_state)) ? 1 : 0;
+}
@@ -0,0 +1,40 @@
+#!/usr/bin/env bash
+
+# This is a simple script to build a firmware and run it under the simavr harness.
+# Needs avr-gcc, avr-libc and simavr (libsimavr-dev or a source build).
+#
+# usage: sim/simbench.sh blf-a6-rmm attiny13 [small] [simbench options]
+#
+# With "small" the firmware is built with build-small.sh instead of build.sh.
+
+iname=$1
+mcu=$2
+shift 2
+oname="${iname}-${mcu}"
+build=./build.sh
+if [ "$1" == "small" ]; then
+	oname="${oname}-small"
+	build=./build-small.sh
+	shift
+fi
+dir=$(dirname "$0")
+
+${build} ${iname} ${mcu} || exit 1
+
+cflags=$(pkg-config --cflags --libs simavr 2>/dev/null || echo "-I/usr/include/simavr -I/usr/local/include/simavr -lsimavr -lelf")
+cc -Wall -O2 -o ${dir}/simbench ${dir}/simbench.c ${cflags} || exit 1
+
+# Functions to time, save_mode_idx per EEPROM save and get_bat per BAT_PERIOD
+syms=""
+for sym in save_mode_idx get_bat; do
+	addr=$(avr-nm ${oname}.elf | awk -v s=${sym} '$3 == s { print $1 }')
+	[ -n "${addr}" ] && syms="${syms} -s ${sym}=0x${addr}"
+done
+
+# main_loop is a label at the top of main()'s loop, every pass goes through it
+loop=$(avr-nm ${oname}.elf | awk '$3 == "main_loop" { print "-l 0x" $1 }')
+
+# Start-up check, .data and .bss have to be set up by the time main runs
+init=$(avr-nm ${oname}.elf | awk '{ a[$3] = "0x" $1 } END { if (a["main"]) print "-i " a["main"] ":" a["__data_start"] ":" a["__data_end"] ":" a["__data_load_start"] ":" a["__bss_end"] }')
+
+${dir}/simbench -m ${mcu} ${syms} ${loop} ${init} "$@" ${oname}.elf
@@ -0,0 +1,441 @@
+/*
+* Click-sequence simulator for the mode state machine, built natively.
+*
+* Compiles ui.h, the firmware's own press handling and mode ring code,
+* against a mocked EEPROM and battery, and replays power-ons on it at host
+* speed under every config (the 128 combinations with CONFIG_SET).  For each
+* config it reports:
+*   - EEPROM writes per cell of the 0..EEPMODE mode ring, from random clicks
+*     (or a recorded sequence with -r), and how many clicks the busiest cell
+*     lasts at EEPROM_ENDURANCE writes
+*   - modes no press sequence lights, from an exhaustive search of the UI
+*     state (saved mode, mode in RAM, locked_in, fast_presses)
+*   - stuck states, from which some lit mode can't be reached any more
+*   - whether 16 fast presses still get to the config menu
+*
+* power_on() makes the same ui.h calls as main() in blf-a6-rmm.c, at boot
+* and on every main loop pass (one per BAT_PERIOD).  Only the loop itself,
+* the low cell step-down and locking in after LOCK_TIME are mirrored here,
+* keep those in step with main().
+*
+* Usage: uisim [options]
+*   -c config    only this config, e.g. 0xa2 (default: all of them, or only
+*                CONFIG_DEFAULT without CONFIG_MENU, as on the attiny13)
+*   -n clicks    random clicks per config (default 100000)
+*   -m s,m,l     short, medium and long press percentages (default 60,25,15)
+*   -l percent   clicks made on a low cell, which steps down every 8s (default 0)
+*   -r file      replay these clicks instead, lines of "s|m|l [seconds held]"
+*   -s seed      random seed (default 1)
+*   -v           print the writes of every ring cell
+*
+* sim/uisim.sh builds it against the settings in driver.h and default_modes.h.
+*/
+
+#define HOST
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../driver.h"
+#include "../default_modes.h"
+
+#define EEPROM_ENDURANCE 100000UL // Erase/write cycles per cell, from the datasheet
+#define CONFIGS 128               // Every combination below CONFIG_SET
+#define NONE 0xFF                 // RAM didn't survive the off time
+
+// Mocked EEPROM, erased like a freshly flashed chip
+static uint8_t eeprom[EEPLEN + 1];
+static uint32_t wear[EEPLEN + 1];
+
+uint8_t EEPROM_read(uint8_t address) {
+	return eeprom[address];
+}
+
+void EEPROM_write(uint8_t address, uint8_t data) {
+	eeprom[address] = data;
+	wear[address]++;
+}
+
+#define debug_rec(tag, value)
+
+static uint32_t shutdowns;
+
+// The cell has recovered by the time the mock returns
+void emergency_shutdown() {
+	shutdowns++;
+}
+
+#include "../ui.h"
+
+static uint8_t mode_mem = NONE; // The firmware's mode_mem, NONE when mode_check wouldn't match
+static uint8_t menu_entered;
+
+static void remember_mode(uint8_t mode_idx, uint8_t config) {
+	mode_mem = reverse_idx(config, mode_idx);
+}
+
+static void eeprom_reset(uint8_t config) {
+	memset(eeprom, 0xFF, sizeof(eeprom));
+	memset(wear, 0, sizeof(wear));
+	eeprom[EEPLEN] = ~config;
+}
+
+// One power-on with the given press, held for ms.  Returns the mode it lit.
+static uint8_t power_on(uint8_t press, uint32_t ms, uint8_t low) {
+	uint8_t config = load_config();
+
+	if (press == PRESS_LONG) { // RAM decayed, fast_presses and locked_in are garbage
+		mode_mem = NONE;
+		fast_presses = rand();
+		locked_in = rand();
+	}
+
+	uint8_t eepos = find_mode_pos();
+	uint8_t mode_idx = last_mode(eepos, mode_mem, mode_mem != NONE);
+	mode_idx = press_mode(mode_idx, config, press);
+	uint8_t lit = mode_idx;
+
+	keep_config(config);
+	remember_mode(mode_idx, config);
+
+	// Main loop passes, the first one right at power-on.  Past the save
+	// nothing changes any more, unless the cell is low.
+	uint32_t passes = (uint32_t)CLOCK_MS(ms) / BAT_PERIOD + 1;
+	if (!low && passes > SAVE_DELAY + 1) {
+		passes = SAVE_DELAY + 1;
+	}
+	uint8_t ticks = 0;
+	uint8_t lowbatt_cnt = 0;
+	while (passes--) {
+#ifdef CONFIG_MENU
+		if (menu_tick(ticks)) {
+			mode_idx = 0;
+			remember_mode(mode_idx, config);
+			menu_entered = 1;
+		}
+#endif
+		if (low && ++lowbatt_cnt >= 8) {
+			lowbatt_cnt = 0;
+			mode_idx = low_batt_stepdown(mode_idx);
+			remember_mode(mode_idx, config);
+		}
+		eepos = save_tick(ticks, mode_idx, config, eepos);
+		ticks++;
+	}
+
+	uint8_t kind = mode_kind[mode_idx];
+	if ((config & LOCK_MODE) && (kind == SOLID || kind == TURBO) && CLOCK_MS(ms) >= LOCK_TIME) {
+		locked_in = 1;
+	}
+	return lit;
+}
+
+/*
+* Random and recorded clicks
+*/
+
+static uint32_t rng = 1;
+
+static uint32_t rnd(uint32_t n) {
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng % n;
+}
+
+static uint8_t mix[3] = { 60, 25, 15 };
+static uint8_t low_pct;
+
+// Mostly quick clicks through the modes, some use, a few long runs
+static uint32_t hold_ms() {
+	uint32_t r = rnd(100);
+	if (r < 50) {
+		return rnd(1000);
+	} else if (r < 85) {
+		return 1000 + rnd(9000);
+	}
+	return 10000 + rnd(590000);
+}
+
+static uint8_t random_press() {
+	uint32_t r = rnd(100);
+	if (r < mix[0]) {
+		return PRESS_SHORT;
+	} else if (r < mix[0] + mix[1]) {
+		return PRESS_MED;
+	}
+	return PRESS_LONG;
+}
+
+struct click {
+	uint8_t press;
+	uint32_t ms;
+};
+
+static struct click *recorded;
+static uint32_t recorded_cnt;
+
+static void read_clicks(const char *fname) {
+	FILE *f = fopen(fname, "r");
+	char line[128];
+	uint32_t size = 0;
+	if (!f) {
+		fprintf(stderr, "%s: can't read clicks\n", fname);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		char p;
+		double s = 0;
+		if (sscanf(line, " %c %lf", &p, &s) < 1 || p == '#') {
+			continue;
+		}
+		if (recorded_cnt == size) {
+			size = size ? size * 2 : 64;
+			recorded = realloc(recorded, size * sizeof(*recorded));
+		}
+		recorded[recorded_cnt].press = p == 'l' ? PRESS_LONG : p == 'm' ? PRESS_MED : PRESS_SHORT;
+		recorded[recorded_cnt].ms = s * 1000;
+		recorded_cnt++;
+	}
+	fclose(f);
+}
+
+/*
+* Exhaustive search of the UI state
+*/
+
+#define MODES (MODE_CNT + 1)
+#define FAST_MAX 16 // Anything over 0x0f enters the config menu
+#define STATES (MODES * (MODES + 1) * 2 * (FAST_MAX + 1))
+#define ACTIONS 9   // Short, medium and long press, each tapped, held a second, or held past the save and lock-in
+
+static const uint32_t action_ms[3] = { 0, 1000, 5000 };
+
+struct state {
+	uint8_t saved;  // Mode in the ring
+	uint8_t ram;    // mode_mem, or NONE
+	uint8_t locked;
+	uint8_t fast;
+};
+
+static uint32_t state_id(struct state s) {
+	uint32_t ram = s.ram == NONE ? MODES : s.ram;
+	return ((s.saved * (MODES + 1) + ram) * 2 + s.locked) * (FAST_MAX + 1) + s.fast;
+}
+
+static struct state state_of(uint32_t id) {
+	struct state s;
+	s.fast = id % (FAST_MAX + 1);
+	id /= FAST_MAX + 1;
+	s.locked = id % 2;
+	id /= 2;
+	s.ram = id % (MODES + 1);
+	if (s.ram == MODES) {
+		s.ram = NONE;
+	}
+	s.saved = id / (MODES + 1);
+	return s;
+}
+
+static uint32_t next_state[STATES][ACTIONS];
+static uint8_t lit_mode[STATES][ACTIONS];
+static uint8_t seen[STATES];
+static uint32_t queue[STATES];
+
+static void step(uint32_t id, uint8_t config, uint8_t action) {
+	struct state s = state_of(id);
+	eeprom_reset(config);
+	eeprom[0] = s.saved;
+	mode_mem = s.ram;
+	locked_in = s.locked;
+	fast_presses = s.fast;
+	menu_entered = 0;
+
+	lit_mode[id][action] = power_on(action / 3, action_ms[action % 3], 0);
+
+	s.saved = eeprom[find_mode_pos()] & ~EEP_GEN;
+	s.ram = mode_mem;
+	s.locked = locked_in ? 1 : 0;
+	s.fast = fast_presses > FAST_MAX ? FAST_MAX : fast_presses;
+	next_state[id][action] = state_id(s);
+	if (menu_entered) {
+		lit_mode[id][action] |= 0x80; // Config menu, the light goes on to mode 0
+	}
+}
+
+// Reachable states from a fresh flash, the modes they light, and the
+// states from which some of those modes can't be lit any more
+static void explore(uint8_t config, uint16_t *lit, uint32_t *stuck, uint8_t *menu) {
+	uint32_t head = 0, tail = 0;
+	uint32_t id, a;
+	struct state fresh = { 0, NONE, 0, 0 };
+	uint8_t m;
+
+	memset(seen, 0, sizeof(seen));
+	*lit = 0;
+	*menu = 0;
+	queue[tail++] = state_id(fresh);
+	seen[queue[0]] = 1;
+	while (head < tail) {
+		id = queue[head++];
+		for (a = 0; a < ACTIONS; a++) {
+			step(id, config, a);
+			*lit |= 1 << (lit_mode[id][a] & 0x7F);
+			*menu |= lit_mode[id][a] >> 7;
+			if (!seen[next_state[id][a]]) {
+				seen[next_state[id][a]] = 1;
+				queue[tail++] = next_state[id][a];
+			}
+		}
+	}
+
+	// For each lit mode, walk back from the transitions that light it
+	*stuck = 0;
+	for (m = 0; m < MODES; m++) {
+		static uint8_t can[STATES];
+		uint8_t changed = 1;
+		uint32_t i;
+		if (!(*lit & (1 << m))) {
+			continue;
+		}
+		memset(can, 0, sizeof(can));
+		while (changed) {
+			changed = 0;
+			for (i = 0; i < tail; i++) {
+				id = queue[i];
+				if (can[id]) {
+					continue;
+				}
+				for (a = 0; a < ACTIONS; a++) {
+					if ((lit_mode[id][a] & 0x7F) == m || can[next_state[id][a]]) {
+						can[id] = 1;
+						changed = 1;
+						break;
+					}
+				}
+			}
+		}
+		for (i = 0; i < tail; i++) {
+			if (!can[queue[i]]) {
+				(*stuck)++;
+			}
+		}
+	}
+}
+
+/*
+* Report
+*/
+
+static void print_modes(uint16_t modes) {
+	uint8_t m, any = 0;
+	char buf[64] = "";
+	for (m = 0; m < MODES; m++) {
+		if (modes & (1 << m)) {
+			sprintf(buf + strlen(buf), "%s%d", any ? "," : "", m);
+			any = 1;
+		}
+	}
+	printf(" %-16s", any ? buf : "-");
+}
+
+static void run(uint8_t config, uint32_t clicks, uint8_t verbose) {
+	uint32_t i, total = 0, min = 0xFFFFFFFF, max = 0;
+	uint16_t lit;
+	uint32_t stuck;
+	uint8_t menu;
+
+	explore(config, &lit, &stuck, &menu);
+
+	eeprom_reset(config);
+	mode_mem = NONE;
+	locked_in = 0;
+	fast_presses = 0;
+	if (recorded) {
+		clicks = recorded_cnt;
+	}
+	for (i = 0; i < clicks; i++) {
+		if (recorded) {
+			power_on(recorded[i].press, recorded[i].ms, 0);
+		} else {
+			uint8_t press = random_press();
+			power_on(press, hold_ms(), rnd(100) < low_pct);
+		}
+	}
+
+	for (i = 0; i <= EEPMODE; i++) {
+		total += wear[i];
+		if (wear[i] < min) min = wear[i];
+		if (wear[i] > max) max = wear[i];
+	}
+	printf("0x%02x %10u %10u %8u %8u %10.1f ", config, clicks, total, min, max,
+		clicks ? 1000.0 * total / clicks : 0);
+	if (max) {
+		printf("%12.3g", (double)clicks * EEPROM_ENDURANCE / max);
+	} else {
+		printf("%12s", "-");
+	}
+	print_modes(((1 << MODES) - 1) & ~lit);
+	printf(" %6u %4s\n", stuck, menu ? "yes" : "NO");
+
+	if (verbose) {
+		for (i = 0; i <= EEPMODE; i++) {
+			printf("%s%6u", i % 8 ? " " : "\n  ", wear[i]);
+		}
+		printf("\n  config cell %u\n", wear[EEPLEN]);
+	}
+}
+
+static void usage(const char *self) {
+	fprintf(stderr, "usage: %s [-c config] [-n clicks] [-m s,m,l] [-l percent] [-r file] [-s seed] [-v]\n", self);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	int config = -1;
+	uint32_t clicks = 100000;
+	uint8_t verbose = 0;
+	unsigned s, m, l;
+
+	while ((opt = getopt(argc, argv, "c:n:m:l:r:s:v")) != -1) {
+		switch (opt) {
+			case 'c': config = strtol(optarg, NULL, 0) & (CONFIGS - 1); break;
+			case 'n': clicks = strtoul(optarg, NULL, 0); break;
+			case 'm':
+				if (sscanf(optarg, "%u,%u,%u", &s, &m, &l) != 3 || s + m + l != 100) {
+					usage(argv[0]);
+				}
+				mix[0] = s;
+				mix[1] = m;
+				mix[2] = l;
+			break;
+			case 'l': low_pct = atoi(optarg); break;
+			case 'r': read_clicks(optarg); break;
+			case 's': rng = strtoul(optarg, NULL, 0) | 1; srand(rng); break;
+			case 'v': verbose = 1; break;
+			default: usage(argv[0]);
+		}
+	}
+
+	printf("%u modes (%u hidden), mode ring 0..%u, %lu write endurance\n",
+		MODES, NUM_HIDDEN, EEPMODE, EEPROM_ENDURANCE);
+	printf("%-4s %10s %10s %8s %8s %10s %12s %-16s %6s %4s\n", "cfg", "clicks", "writes",
+		"min/cell", "max/cell", "per 1k", "lifetime", "unreachable", "stuck", "menu");
+#ifndef CONFIG_MENU
+	if (config < 0) {            // Nothing can change the config
+		run(CONFIG_DEFAULT, clicks, verbose);
+		return 0;
+	}
+#endif
+	if (config >= 0) {
+		run(config | CONFIG_SET, clicks, 1);
+	} else {
+		for (config = 0; config < CONFIGS; config++) {
+			run(config | CONFIG_SET, clicks, verbose);
+		}
+	}
+	return 0;
+}
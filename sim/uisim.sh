@@ -0,0 +1,15 @@
+#!/usr/bin/env bash
+
+# This is a simple script to build the mode logic natively and run the click simulator.
+# Needs a host C compiler only, the settings come from driver.h and default_modes.h.
+#
+# usage: sim/uisim.sh attiny13 [uisim options]
+
+mcu=$1
+shift 1
+mcuvar=$(echo ${mcu} | egrep -o '[0-9]{1,3}')
+dir=$(dirname "$0")
+
+cc -Wall -O2 -fgnu89-inline -D ATTINY=${mcuvar} -o ${dir}/uisim ${dir}/uisim.c || exit 1
+
+${dir}/uisim "$@"
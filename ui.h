@@ -0,0 +1,202 @@
+#ifndef UI_H_
+#define UI_H_
+/*
+* Mode state machine, what a press does and where the mode index is kept,
+* and the boot and per-tick bookkeeping main() does around it.
+*
+* Nothing in here touches a register, so sim/uisim.c builds it natively.
+* The includer provides:
+*
+*	EEPROM_read(), EEPROM_write()  the EEPROM, or the simulator's mock
+*	emergency_shutdown()           returns only if the cell has recovered
+*	debug_rec()                    a function or an empty macro
+*/
+
+void emergency_shutdown();
+
+uint8_t fast_presses __attribute__ ((section (".noinit"))); // counter for entering config mode
+uint8_t locked_in  __attribute__ ((section (".noinit")));   // LOCK_MODE variable
+
+// Off time, from the cap reading at power-on
+#define PRESS_SHORT 0
+#define PRESS_MED   1
+#define PRESS_LONG  2
+
+static void save_config(uint8_t config) {
+	EEPROM_write(EEPLEN, ~config); // Config is stationary
+}
+
+// The config byte, or CONFIG_DEFAULT if CONFIG_SET is clear, which it is on a
+// fresh flash and after the menu wipes the config
+static inline uint8_t load_config() {
+	uint8_t config = ~EEPROM_read(EEPLEN);
+	if (!(config & CONFIG_SET)) {
+		config = CONFIG_DEFAULT;
+	}
+	return config;
+}
+
+// Write a wiped config back as CONFIG_DEFAULT, done once the light is on
+static inline void keep_config(uint8_t config) {
+	if ((uint8_t)~EEPROM_read(EEPLEN) != config) {
+		save_config(config);
+	}
+}
+
+static inline uint8_t reverse_idx(uint8_t config, uint8_t mode_idx) {
+	// Reverse the index if the config option is set and the index is in normal modes
+	if ((config & MODE_DIR) && (mode_idx < NUM_MODES) && !(config & MUGGLE)) {
+		mode_idx = (NUM_MODES - 1 - mode_idx);
+	}
+	return mode_idx;
+}
+
+// Find the newest cell of the mode ring.  Cells written during the current lap
+// carry the same generation bit as cell 0 and the rest carry the other one
+// (erased cells read as 0xFF), so the boundary can be found with a binary search.
+static uint8_t find_mode_pos() {
+	uint8_t gen = EEPROM_read(0) & EEP_GEN;
+	uint8_t lo = 0;           // Always has the generation of cell 0
+	uint8_t hi = EEPMODE + 1; // Never does, one past the end of the ring
+	while ((uint8_t)(hi - lo) > 1) {
+		uint8_t mid = lo + ((uint8_t)(hi - lo) >> 1); // Stays in 8 bits, lo + hi needs 9
+		if ((EEPROM_read(mid) & EEP_GEN) == gen) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// Write mode index to EEPROM (with wear leveling).  Out of line so that
+// sim/simbench.sh can time it.
+static __attribute__ ((noinline)) uint8_t save_mode_idx(uint8_t mode_idx, uint8_t config, uint8_t eepos) {
+	mode_idx = reverse_idx(config, mode_idx); // Reverse the mode index if needed
+	uint8_t cell = EEPROM_read(eepos);
+
+	if ((cell & ~EEP_GEN) == mode_idx) {      // Already stored, save the write cycle
+		return eepos;
+	}
+
+	cell &= EEP_GEN;
+	if (eepos == EEPMODE) {                   // Wear leveling, use next cell, roll over if we hit the end of mode index storage
+		eepos=0;
+		cell ^= EEP_GEN;                      // and start a new generation
+		} else {
+		eepos++;
+	}
+
+	EEPROM_write(eepos, mode_idx | cell);     // Atomic erase and write, the old cell doesn't need erasing
+	debug_rec(DBG_EEPOS, eepos);
+	return eepos;
+}
+
+// Mode index the press is applied to: the newest ring cell, or the mode kept
+// in RAM if RAM survived the off time (mem_ok), since that's at least as new
+static inline uint8_t last_mode(uint8_t eepos, uint8_t mem, uint8_t mem_ok) {
+	uint8_t mode_idx = EEPROM_read(eepos) & ~EEP_GEN;
+	if (mem_ok) {
+		mode_idx = mem;
+	}
+	if (mode_idx > MODE_CNT) { // Empty ring or garbage
+		mode_idx = 0;
+	}
+	return mode_idx;
+}
+
+// Main loop tick bookkeeping, ticks counts them from power-on.
+// Save the mode once it's been held long enough, unchanged modes aren't rewritten.
+static inline uint8_t save_tick(uint8_t ticks, uint8_t mode_idx, uint8_t config, uint8_t eepos) {
+	if (ticks >= SAVE_DELAY) {
+		eepos = save_mode_idx(mode_idx, config, eepos);
+	}
+	return eepos;
+}
+
+#ifdef CONFIG_MENU
+// Whether the fast presses asked for the config menu.  That's only looked at
+// on the first tick, on any later one the user has stopped fast-pressing.
+// Either way the presses are used up.
+static inline uint8_t menu_tick(uint8_t ticks) {
+	uint8_t menu = !ticks && fast_presses > 0x0f;
+	if (ticks || menu) {
+		fast_presses = 0;
+	}
+	return menu;
+}
+#endif
+
+static inline uint8_t med_press(uint8_t mode_idx, uint8_t config, uint8_t i) {
+	if (mode_idx >= MODE_CNT) { // Loop back if we've hit the end of hidden modes
+		mode_idx = 0;
+	} else if ((mode_idx < i) || ((config & MOON_MODE) && (mode_idx == i))) { // If there's no mode i below, go to hidden modes
+		mode_idx = NUM_MODES;
+	} else if (mode_idx < NUM_MODES) { // Walk backwards if we're in normal modes
+		mode_idx -= i;
+	} else if (mode_idx >= NUM_MODES) { // Walk forward if we're in hidden modes
+		mode_idx += 1;
+	}
+	return mode_idx;
+}
+
+static inline uint8_t next(uint8_t mode_idx, uint8_t config, uint8_t i) {
+	mode_idx += i;        // Start out by just incrementing the mode
+
+	if ((mode_idx >= NUM_MODES) || ((config & MUGGLE) && (mode_idx > (NUM_MODES - 3)))) {
+		mode_idx = 0;	  // If we're at or above the brightest mode, or we're in muggle mode
+						  // and we're above the third-highest mode, drop to the lowest brightness
+	}
+
+	return mode_idx;
+}
+
+static inline uint8_t low_batt_stepdown(uint8_t mode_idx) {
+	if (mode_idx == 0) {                     // If we're already at 0, turn off, and carry on at 0 if the cell recovers
+		emergency_shutdown();
+	} else if (mode_idx > TURBO_STEP_DOWN) { // Drop out of hidden modes to TURBO_STEP_DOWN
+		mode_idx = TURBO_STEP_DOWN;
+	} else {                                 // If we're below TURBO_STEP_DOWN, then reduce the mode index again.
+		mode_idx--;
+	}
+	debug_rec(DBG_STEP, mode_idx);
+
+	return mode_idx;
+}
+
+// The mode to light up in, from the last one and the press that turned the light on
+static inline uint8_t press_mode(uint8_t mode_idx, uint8_t config, uint8_t press) {
+	// First, get the "mode group" (increment value)
+	uint8_t i = MODE1INC; // Set to 2 for mode group 2 step augmentation
+	if (config & MODE_GROUP) {
+		i = MODE2INC;
+	}
+
+	if (press == PRESS_LONG || (press == PRESS_MED && !(config & MED_PRESS))) {
+		// Long press, clear fast_presses
+		fast_presses = 0;
+		// Reset to the first mode if memory isn't set on
+		if (!(config & MEMORY)) {
+			mode_idx = 0;
+		}
+		locked_in = 0;
+		} else if (locked_in && (config & LOCK_MODE)) {
+			// Do nothing
+		} else if ((press == PRESS_MED) && !(config & MUGGLE)) {
+			// User did a medium press
+			mode_idx = med_press(mode_idx, config, i);
+		} else {
+			// We don't care what the value is as long as it's over 15
+			fast_presses = (fast_presses+1) & 0x1f;
+			// Indicates they did a short press, go to the next mode
+			mode_idx = next(mode_idx, config, i);
+	}
+
+	if ((config & MOON_MODE) && !mode_idx) { // If moon mode is on and the index is 0, increment the mode once to disable moon mode
+		mode_idx += i;
+	}
+
+	return reverse_idx(config, mode_idx); // Reverse the index if needed
+}
+
+#endif /* UI_H_ */